@@ -0,0 +1,409 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Append-only event journal. See journal.h for the on-flash layout.
+*/
+
+#include <string.h>
+#include "journal.h"
+
+#define ERASED_LENGTH 0xFFFF
+#define RECORD_ALIGN 4 /* Keeps padding at least 4 bytes so an erased length field is always readable. */
+
+_Static_assert(sizeof(journal_segment_header_t) == 16, "Segment header layout changed.");
+_Static_assert(sizeof(journal_record_header_t) == 16, "Record header layout changed.");
+
+
+/********** Helpers start. **********/
+static uint32_t roundUp(uint32_t value, uint32_t align) {
+    return (value + align - 1) / align * align;
+}
+
+static uint32_t segmentBase(const journal_t *journal, uint32_t index) {
+    return index * journal->flash.sector_size;
+}
+
+/* Counts bytes into *bytes_read when it is not NULL. Used to measure recovery cost. */
+static journal_err_t flashRead(const journal_flash_t *flash, uint32_t *bytes_read, uint32_t addr, void *buf, size_t len) {
+    if(flash->read(flash->ctx, addr, buf, len) != 0) {
+        return JOURNAL_ERR_FLASH;
+    }
+    if(bytes_read != NULL) {
+        *bytes_read += len;
+    }
+    return JOURNAL_OK;
+}
+
+static bool segmentHeaderValid(const journal_segment_header_t *header) {
+    return header->magic == JOURNAL_SEGMENT_MAGIC &&
+           header->crc == journal_crc32(0, header, offsetof(journal_segment_header_t, crc));
+}
+
+static uint32_t recordCrc(const journal_record_header_t *header, const uint8_t *payload) {
+    uint32_t crc = journal_crc32(0, header, offsetof(journal_record_header_t, crc));
+    return journal_crc32(crc, payload, header->length);
+}
+
+/*
+    Reads the record at *offset inside a segment and moves *offset past it.
+    Page padding left by journal_flush() is skipped. Erased flash ends the
+    segment cleanly. A bad length or CRC mismatch returns JOURNAL_ERR_CORRUPT,
+    which also ends the segment and is how a torn write is dropped.
+*/
+static journal_err_t readRecord(const journal_flash_t *flash, uint32_t *bytes_read, uint32_t base, uint32_t *offset,
+                                journal_record_header_t *header, uint8_t *payload, size_t payload_cap) {
+    uint8_t buf[JOURNAL_MAX_PAYLOAD];
+    journal_err_t err;
+
+    while(true) {
+        if(*offset + sizeof(*header) > flash->sector_size) {
+            return JOURNAL_ERR_END;
+        }
+
+        err = flashRead(flash, bytes_read, base + *offset, header, sizeof(*header));
+        if(err != JOURNAL_OK) {
+            return err;
+        }
+
+        if(header->length != ERASED_LENGTH) {
+            break;
+        }
+        if(*offset % JOURNAL_PAGE_SIZE == 0) { /* Nothing was ever written here. */
+            return JOURNAL_ERR_END;
+        }
+        *offset = roundUp(*offset, JOURNAL_PAGE_SIZE); /* Padding. Next record starts on the next page. */
+    }
+
+    if(header->length > JOURNAL_MAX_PAYLOAD || *offset + sizeof(*header) + header->length > flash->sector_size) {
+        return JOURNAL_ERR_CORRUPT;
+    }
+
+    err = flashRead(flash, bytes_read, base + *offset + sizeof(*header), buf, header->length);
+    if(err != JOURNAL_OK) {
+        return err;
+    }
+
+    if(header->crc != recordCrc(header, buf)) {
+        return JOURNAL_ERR_CORRUPT;
+    }
+
+    if(payload != NULL) {
+        if(payload_cap < header->length) {
+            return JOURNAL_ERR_ARG;
+        }
+        memcpy(payload, buf, header->length);
+    }
+
+    *offset += roundUp(sizeof(*header) + header->length, RECORD_ALIGN);
+    return JOURNAL_OK;
+} /* End of readRecord(). */
+/********** Helpers end. **********/
+
+
+/********** Page buffer start. **********/
+/*
+    Pads the rest of the page with erased bytes and programs it as a whole.
+    A failed program may have left part of the page written, and readers stop
+    at it, so the rest of the segment is abandoned the same way journal_mount()
+    abandons a corrupt tail. Records staged in the page are lost and the next
+    append opens a new segment instead of programming the page again.
+*/
+static journal_err_t programPage(journal_t *journal) {
+    memset(journal->page_buf + journal->page_fill, 0xFF, JOURNAL_PAGE_SIZE - journal->page_fill);
+
+    if(journal->flash.write(journal->flash.ctx, journal->page_addr, journal->page_buf, JOURNAL_PAGE_SIZE) != 0) {
+        ++journal->stats.write_errors;
+        journal->page_addr = segmentBase(journal, journal->head_index) + journal->flash.sector_size;
+        journal->page_fill = 0;
+        return JOURNAL_ERR_FLASH;
+    }
+
+    journal->stats.bytes_programmed += JOURNAL_PAGE_SIZE;
+    ++journal->stats.pages_programmed;
+    journal->page_addr += JOURNAL_PAGE_SIZE;
+    journal->page_fill = 0;
+    return JOURNAL_OK;
+} /* End of programPage(). */
+
+static journal_err_t putBytes(journal_t *journal, const void *data, size_t len) {
+    const uint8_t *src = data;
+
+    while(len > 0) {
+        size_t room = JOURNAL_PAGE_SIZE - journal->page_fill;
+        size_t chunk = len < room ? len : room;
+
+        memcpy(journal->page_buf + journal->page_fill, src, chunk);
+        journal->page_fill += chunk;
+        src += chunk;
+        len -= chunk;
+
+        if(journal->page_fill == JOURNAL_PAGE_SIZE) {
+            journal_err_t err = programPage(journal);
+            if(err != JOURNAL_OK) {
+                return err;
+            }
+        }
+    }
+
+    return JOURNAL_OK;
+} /* End of putBytes(). */
+
+/* Erases the next segment in the ring, dropping its oldest records, and stages its header. */
+static journal_err_t openNextSegment(journal_t *journal) {
+    uint32_t index = (journal->head_index + 1) % journal->segment_count;
+    uint32_t base = segmentBase(journal, index);
+
+    if(journal->flash.erase_sector(journal->flash.ctx, base) != 0) {
+        return JOURNAL_ERR_FLASH;
+    }
+    ++journal->stats.sectors_erased;
+
+    journal->head_index = index;
+    ++journal->head_seq;
+    journal->page_addr = base;
+    journal->page_fill = 0;
+
+    journal_segment_header_t header = {
+        .magic = JOURNAL_SEGMENT_MAGIC,
+        .seq = journal->head_seq,
+        .first_record_seq = journal->next_record_seq
+    };
+    header.crc = journal_crc32(0, &header, offsetof(journal_segment_header_t, crc));
+
+    /* Header goes out with the first page of records instead of on its own. */
+    return putBytes(journal, &header, sizeof(header));
+} /* End of openNextSegment(). */
+/********** Page buffer end. **********/
+
+
+/********** Public API start. **********/
+/* Reflected CRC-32 (same polynomial as zlib), using a 16 entry table to stay small. */
+uint32_t journal_crc32(uint32_t crc, const void *data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8_t *p = data;
+
+    crc = ~crc;
+    while(len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+} /* End of journal_crc32(). */
+
+/*
+    Reads every segment header to find the newest segment, then scans only that
+    segment for the end of the last intact record. Appending resumes on the next
+    page boundary so a page is never programmed twice. If the tail is corrupt the
+    rest of the segment is abandoned, since readers stop at the first bad record.
+*/
+journal_err_t journal_mount(journal_t *journal, const journal_flash_t *flash) {
+    memset(journal, 0, sizeof(*journal));
+    journal->flash = *flash;
+
+    if(flash->sector_size == 0 || flash->sector_size % JOURNAL_PAGE_SIZE != 0 || flash->size % flash->sector_size != 0) {
+        return JOURNAL_ERR_ARG;
+    }
+
+    journal->segment_count = flash->size / flash->sector_size;
+    if(journal->segment_count < 2) {
+        return JOURNAL_ERR_ARG;
+    }
+
+    journal_segment_header_t head_header;
+    bool found = false;
+
+    for(uint32_t i = 0; i < journal->segment_count; ++i) {
+        journal_segment_header_t header;
+        journal_err_t err = flashRead(flash, &journal->stats.mount_bytes_read, segmentBase(journal, i), &header, sizeof(header));
+        if(err != JOURNAL_OK) {
+            return err;
+        }
+
+        if(segmentHeaderValid(&header) && (!found || (int32_t)(header.seq - head_header.seq) > 0)) {
+            head_header = header;
+            journal->head_index = i;
+            found = true;
+        }
+    }
+
+    if(!found) {
+        /* Blank region. Pretend the last segment is full so the first append opens segment 0. */
+        journal->head_index = journal->segment_count - 1;
+        journal->head_seq = 0;
+        journal->next_record_seq = 0;
+        journal->page_addr = segmentBase(journal, journal->segment_count);
+        return JOURNAL_OK;
+    }
+
+    uint32_t base = segmentBase(journal, journal->head_index);
+    uint32_t offset = sizeof(journal_segment_header_t);
+    uint32_t end = offset;
+    journal_record_header_t record;
+
+    journal->head_seq = head_header.seq;
+    journal->next_record_seq = head_header.first_record_seq;
+
+    while(true) {
+        journal_err_t err = readRecord(flash, &journal->stats.mount_bytes_read, base, &offset, &record, NULL, 0);
+        if(err == JOURNAL_ERR_CORRUPT) {
+            end = journal->flash.sector_size; /* Next append opens a new segment. */
+            break;
+        }
+        if(err == JOURNAL_ERR_END) {
+            break;
+        }
+        if(err != JOURNAL_OK) {
+            return err;
+        }
+        journal->next_record_seq = record.seq + 1;
+        end = offset;
+    }
+
+    journal->page_addr = base + roundUp(end, JOURNAL_PAGE_SIZE);
+    journal->page_fill = 0;
+    return JOURNAL_OK;
+} /* End of journal_mount(). */
+
+/* Stages a record in the page buffer. Flash is only written when a page fills up.
+   On JOURNAL_ERR_FLASH the record is not kept and its sequence number is reused. */
+journal_err_t journal_append(journal_t *journal, uint8_t type, uint32_t timestamp_ms, const void *payload, size_t len) {
+    static const uint8_t pad[RECORD_ALIGN] = {0xFF, 0xFF, 0xFF, 0xFF};
+    journal_err_t err;
+
+    if(len > JOURNAL_MAX_PAYLOAD) {
+        return JOURNAL_ERR_ARG;
+    }
+
+    uint32_t total = roundUp(sizeof(journal_record_header_t) + len, RECORD_ALIGN);
+    uint32_t segment_end = segmentBase(journal, journal->head_index) + journal->flash.sector_size;
+
+    if(journal->page_addr + journal->page_fill + total > segment_end) {
+        err = journal_flush(journal);
+        if(err != JOURNAL_OK) {
+            return err;
+        }
+        err = openNextSegment(journal);
+        if(err != JOURNAL_OK) {
+            return err;
+        }
+    }
+
+    journal_record_header_t header = {
+        .length = (uint16_t)len,
+        .type = type,
+        .reserved = 0,
+        .seq = journal->next_record_seq,
+        .timestamp_ms = timestamp_ms
+    };
+    header.crc = recordCrc(&header, payload);
+
+    err = putBytes(journal, &header, sizeof(header));
+    if(err == JOURNAL_OK) {
+        err = putBytes(journal, payload, len);
+    }
+    if(err == JOURNAL_OK) {
+        err = putBytes(journal, pad, total - sizeof(header) - len);
+    }
+    if(err != JOURNAL_OK) {
+        return err;
+    }
+
+    ++journal->next_record_seq;
+    ++journal->stats.records_appended;
+    journal->stats.bytes_appended += sizeof(header) + len;
+    return JOURNAL_OK;
+} /* End of journal_append(). */
+
+/* Writes out a partially filled page. The rest of that page is left as padding. */
+journal_err_t journal_flush(journal_t *journal) {
+    if(journal->page_fill == 0) {
+        return JOURNAL_OK;
+    }
+    return programPage(journal);
+} /* End of journal_flush(). */
+
+/* Erases the whole region. */
+journal_err_t journal_format(journal_t *journal) {
+    for(uint32_t i = 0; i < journal->segment_count; ++i) {
+        if(journal->flash.erase_sector(journal->flash.ctx, segmentBase(journal, i)) != 0) {
+            return JOURNAL_ERR_FLASH;
+        }
+        ++journal->stats.sectors_erased;
+    }
+
+    journal->head_index = journal->segment_count - 1;
+    journal->head_seq = 0;
+    journal->next_record_seq = 0;
+    journal->page_addr = segmentBase(journal, journal->segment_count);
+    journal->page_fill = 0;
+    return JOURNAL_OK;
+} /* End of journal_format(). */
+
+/* Iterates from the oldest segment to the newest. Records still in the page buffer are not seen. */
+void journal_iter_init(const journal_t *journal, journal_iter_t *iter) {
+    iter->journal = journal;
+    iter->visited = 0;
+    iter->segment_index = (journal->head_index + 1) % journal->segment_count;
+    iter->offset = 0;
+    iter->in_segment = false;
+} /* End of journal_iter_init(). */
+
+journal_err_t journal_iter_next(journal_iter_t *iter, journal_record_header_t *header, uint8_t *payload, size_t payload_cap) {
+    const journal_t *journal = iter->journal;
+    journal_err_t err;
+
+    while(iter->in_segment || iter->visited < journal->segment_count) {
+        uint32_t base = segmentBase(journal, iter->segment_index);
+
+        if(!iter->in_segment) {
+            journal_segment_header_t segment_header;
+            err = flashRead(&journal->flash, NULL, base, &segment_header, sizeof(segment_header));
+            if(err != JOURNAL_OK) {
+                return err;
+            }
+
+            if(segmentHeaderValid(&segment_header)) {
+                iter->in_segment = true;
+                iter->offset = sizeof(segment_header);
+                continue;
+            }
+        }
+        else {
+            err = readRecord(&journal->flash, NULL, base, &iter->offset, header, payload, payload_cap);
+            if(err != JOURNAL_ERR_END && err != JOURNAL_ERR_CORRUPT) {
+                return err;
+            }
+            iter->in_segment = false;
+        }
+
+        iter->segment_index = (iter->segment_index + 1) % journal->segment_count;
+        ++iter->visited;
+    }
+
+    return JOURNAL_ERR_END;
+} /* End of journal_iter_next(). */
+
+/* Flushes, then streams every record to cb one at a time. Stops early if cb returns false. */
+journal_err_t journal_export(journal_t *journal, journal_export_cb_t cb, void *ctx) {
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    journal_record_t record = { .payload = payload };
+    journal_iter_t iter;
+    journal_err_t err = journal_flush(journal);
+
+    if(err != JOURNAL_OK) {
+        return err;
+    }
+
+    journal_iter_init(journal, &iter);
+    while((err = journal_iter_next(&iter, &record.header, payload, sizeof(payload))) == JOURNAL_OK) {
+        if(!cb(ctx, &record)) {
+            return JOURNAL_OK;
+        }
+    }
+
+    return err == JOURNAL_ERR_END ? JOURNAL_OK : err;
+} /* End of journal_export(). */
+/********** Public API end. **********/
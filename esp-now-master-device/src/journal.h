@@ -0,0 +1,127 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Append-only event journal stored in a dedicated flash partition.
+
+The journal splits its flash region into segments of one erase sector each and
+uses them as a ring. Every segment starts with a CRC-checked header carrying a
+sequence number, followed by CRC-checked records. Records are staged in a RAM
+page buffer and only whole pages are programmed, so flash is written in page
+sized batches and every sector is erased the same number of times.
+
+Recovery after power loss reads the header of each segment to find the newest
+one, then scans only that segment to find where the last good record ended.
+
+The engine does not call ESP-IDF directly. Flash access goes through
+journal_flash_t so the same code can run against a file on a host machine.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_PAGE_SIZE 256 /* Flash program page. */
+#define JOURNAL_SEGMENT_MAGIC 0x4C4E524A /* "JRNL". */
+#define JOURNAL_MAX_PAYLOAD 128
+#define JOURNAL_MAC_LEN 6
+
+typedef enum journal_err {
+    JOURNAL_OK,
+    JOURNAL_ERR_ARG, /* Bad geometry or payload too large. */
+    JOURNAL_ERR_FLASH, /* Underlying read/write/erase failed. */
+    JOURNAL_ERR_CORRUPT, /* Bad length or CRC. Left behind by a write torn by power loss. */
+    JOURNAL_ERR_END /* Iterator has no more records. */
+} journal_err_t;
+
+typedef enum journal_record_type {
+    JOURNAL_REC_FRAME = 1, /* Raw ESP-NOW frame. Payload: sender MAC + frame bytes. */
+    JOURNAL_REC_EVENT = 2 /* Event derived from a frame. Payload: sender MAC + journal_event_t + sensor channel. */
+} journal_record_type_t;
+
+typedef enum journal_event {
+    JOURNAL_EVENT_BOOT = 1,
+    JOURNAL_EVENT_MAIL_ARRIVED,
+    JOURNAL_EVENT_MAILBOX_EMPTIED,
+    JOURNAL_EVENT_SLAVE_ERROR
+} journal_event_t;
+
+/* Flash access. Addresses are offsets inside the journal region.
+   Each callback returns 0 on success. */
+typedef struct journal_flash {
+    void *ctx;
+    int (*read)(void *ctx, uint32_t addr, void *buf, size_t len);
+    int (*write)(void *ctx, uint32_t addr, const void *buf, size_t len);
+    int (*erase_sector)(void *ctx, uint32_t addr);
+    uint32_t size; /* Region size in bytes. */
+    uint32_t sector_size; /* Erase unit. Must be a multiple of JOURNAL_PAGE_SIZE. */
+} journal_flash_t;
+
+typedef struct journal_segment_header {
+    uint32_t magic;
+    uint32_t seq; /* Increases by one every time a segment is opened. */
+    uint32_t first_record_seq; /* Sequence number of the first record in this segment. */
+    uint32_t crc;
+} journal_segment_header_t;
+
+typedef struct journal_record_header {
+    uint16_t length; /* Payload bytes. 0xFFFF means erased flash. */
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t seq;
+    uint32_t timestamp_ms;
+    uint32_t crc; /* Covers the fields above and the payload. */
+} journal_record_header_t;
+
+/* Counters for write amplification and wear. */
+typedef struct journal_stats {
+    uint32_t records_appended;
+    uint32_t bytes_appended; /* Record headers + payloads handed to the journal. */
+    uint32_t bytes_programmed; /* Bytes actually written to flash. */
+    uint32_t pages_programmed;
+    uint32_t sectors_erased;
+    uint32_t write_errors; /* Failed page programs. Each one abandons the rest of its segment. */
+    uint32_t mount_bytes_read; /* Flash read during the last journal_mount(). */
+} journal_stats_t;
+
+typedef struct journal {
+    journal_flash_t flash;
+    uint32_t segment_count;
+    uint32_t head_index; /* Segment currently being appended to. */
+    uint32_t head_seq;
+    uint32_t next_record_seq;
+    uint32_t page_addr; /* Flash address of the page held in page_buf. */
+    uint32_t page_fill; /* Bytes used in page_buf. */
+    journal_stats_t stats;
+    uint8_t page_buf[JOURNAL_PAGE_SIZE];
+} journal_t;
+
+typedef struct journal_iter {
+    const journal_t *journal;
+    uint32_t visited; /* Segments visited so far. */
+    uint32_t segment_index;
+    uint32_t offset; /* Offset of the next record inside the current segment. */
+    bool in_segment;
+} journal_iter_t;
+
+/* Record handed to export callbacks. Payload is valid only during the call. */
+typedef struct journal_record {
+    journal_record_header_t header;
+    const uint8_t *payload;
+} journal_record_t;
+
+typedef bool (*journal_export_cb_t)(void *ctx, const journal_record_t *record);
+
+journal_err_t journal_mount(journal_t *journal, const journal_flash_t *flash);
+journal_err_t journal_append(journal_t *journal, uint8_t type, uint32_t timestamp_ms, const void *payload, size_t len);
+journal_err_t journal_flush(journal_t *journal);
+journal_err_t journal_format(journal_t *journal);
+
+void journal_iter_init(const journal_t *journal, journal_iter_t *iter);
+journal_err_t journal_iter_next(journal_iter_t *iter, journal_record_header_t *header, uint8_t *payload, size_t payload_cap);
+journal_err_t journal_export(journal_t *journal, journal_export_cb_t cb, void *ctx);
+
+uint32_t journal_crc32(uint32_t crc, const void *data, size_t len);
+
+#endif /* JOURNAL_H */
@@ -12,7 +12,13 @@ Purpose: This source code is meant to be uploaded to Master ESP32 device.
 #include <esp_mac.h>
 #include <string.h>
 #include <driver/gpio.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
 #include "../../misc-headers/esp-now-message-struct.h"
+#include "journal.h"
 
 #define CHANNEL 6
 #define RED_LED_PIN 25
@@ -20,11 +26,41 @@ Purpose: This source code is meant to be uploaded to Master ESP32 device.
 #define HIGH 1
 #define LOW 0
 
+/* Journal. */
+#define JOURNAL_PARTITION_LABEL "journal"
+#define JOURNAL_PARTITION_SUBTYPE 0x40 /* Custom data subtype. See partitions.csv. */
+#define JOURNAL_FLUSH_INTERVAL_MS 10000 /* Unflushed records are at most this old when power is lost. */
+#define JOURNAL_QUEUE_LENGTH 32 /* Entries waiting for journalTask(). Entries are dropped when full. */
+#define JOURNAL_TASK_STACK_SIZE 4096
+#define JOURNAL_TASK_PRIORITY 2 /* Below the Wi-Fi task. */
+#define JOURNAL_MAX_FLASH_ERRORS 3 /* Failed page programs in a row before journaling stops. Each one costs a segment. */
+/* Export: send JOURNAL_EXPORT_COMMAND from the serial monitor (pio device monitor) at any time.
+   The journal is printed between "Journal export start." and "Journal export end." lines,
+   one record per line: J <seq> <timestamp_ms> <type> <payload hex>. A full journal takes over a minute at 115200 baud. */
+#define JOURNAL_EXPORT_COMMAND 'e'
+#define JOURNAL_POLL_MS 200 /* How often journalTask() checks the serial console for a command. */
+#define JOURNAL_EXPORT_ON_BOOT 0 /* 1: also dump the journal at boot, before any command. */
+
 
 /* Callback function prototype. */
 void onSent(const esp_now_send_info_t *peer_info, esp_now_send_status_t status);
 void onReceived(const esp_now_recv_info_t *peer_info, const uint8_t *data_received, int data_len);
 
+/* Entry handed from the ESP-NOW receive callback to journalTask(). */
+typedef struct journal_entry {
+    uint8_t type;
+    uint8_t length;
+    uint32_t timestamp_ms;
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+} journal_entry_t;
+
+/* Journal state. Only journalTask() touches journal once it is running, so no lock is needed.
+   The receive callback runs on the Wi-Fi task and must not wait on flash, so it only queues entries. */
+journal_t journal;
+QueueHandle_t journal_queue = NULL;
+uint32_t journal_dropped = 0;
+volatile bool journal_stopped = false; /* Set by journalTask() when the partition keeps failing. */
+
 
 /* Setup. */
 
@@ -73,6 +109,195 @@ void configPins() {
     gpio_set_level(GREEN_LED_PIN, LOW);
 }
 
+/* Journal setup and logging. */
+
+int journalFlashRead(void *ctx, uint32_t addr, void *buf, size_t len) {
+    return esp_partition_read((const esp_partition_t *)ctx, addr, buf, len) == ESP_OK ? 0 : -1;
+}
+
+int journalFlashWrite(void *ctx, uint32_t addr, const void *buf, size_t len) {
+    return esp_partition_write((const esp_partition_t *)ctx, addr, buf, len) == ESP_OK ? 0 : -1;
+}
+
+int journalFlashErase(void *ctx, uint32_t addr) {
+    const esp_partition_t *partition = ctx;
+    return esp_partition_erase_range(partition, addr, partition->erase_size) == ESP_OK ? 0 : -1;
+}
+
+/* Prints one record per line: seq, timestamp, type, then the payload in hex. */
+bool exportRecord(void *ctx, const journal_record_t *record) {
+    printf("J %lu %lu %u ", (unsigned long)record->header.seq, (unsigned long)record->header.timestamp_ms, record->header.type);
+    for(uint16_t i = 0; i < record->header.length; ++i) {
+        printf("%02x", record->payload[i]);
+    }
+    printf("\n");
+    return true;
+}
+
+/* Flushes first, so every record received so far is included. */
+journal_err_t journalExport() {
+    printf("\nJournal export start.\n");
+    journal_err_t err = journal_export(&journal, exportRecord, NULL);
+    printf("Journal export end.\n");
+    return err;
+}
+
+/* Non-blocking. The console UART has no driver installed, so stdin returns EOF when nothing was typed. */
+bool journalExportRequested() {
+    int c = getchar();
+
+    if(c == EOF) {
+        clearerr(stdin);
+        return false;
+    }
+    return c == JOURNAL_EXPORT_COMMAND;
+}
+
+/* Logs a failed journal call. After a flash error the journal has already skipped the failed page,
+   but it is remounted so RAM state matches the chip. Returns false when journaling should stop:
+   the remount failed, or JOURNAL_MAX_FLASH_ERRORS programs failed with no good one in between,
+   which would otherwise erase the ring segment by segment. */
+bool journalRecover(journal_err_t err, const char *what, uint32_t *flash_errors) {
+    printf("Journal %s failed (%d).\n", what, err);
+
+    if(err != JOURNAL_ERR_FLASH) {
+        return true;
+    }
+
+    if(++*flash_errors >= JOURNAL_MAX_FLASH_ERRORS) {
+        return false;
+    }
+
+    journal_flash_t flash = journal.flash; /* journal_mount() clears journal first. */
+    err = journal_mount(&journal, &flash);
+    if(err != JOURNAL_OK) {
+        printf("Journal remount failed (%d).\n", err);
+        return false;
+    }
+    printf("Journal remounted. Next record #%lu.\n", (unsigned long)journal.next_record_seq);
+    return true;
+}
+
+/* Does every journal append, flush and export. Records are batched in RAM until a page fills,
+   so it also flushes periodically to save quiet periods. */
+void journalTask(void *arg) {
+    journal_entry_t entry;
+    journal_err_t err;
+    TickType_t last_flush = xTaskGetTickCount();
+    uint32_t flash_errors = 0; /* Failed programs since the last good one. */
+    uint32_t pages_programmed = journal.stats.pages_programmed;
+
+    if(JOURNAL_EXPORT_ON_BOOT && journalExport() != JOURNAL_OK) {
+        printf("Journal export failed.\n");
+    }
+    printf("Journal: send '%c' over serial to export it.\n", JOURNAL_EXPORT_COMMAND);
+
+    while(true) {
+        if(journalExportRequested()) {
+            err = journalExport();
+            if(err != JOURNAL_OK && !journalRecover(err, "export", &flash_errors)) {
+                break;
+            }
+        }
+
+        if(xQueueReceive(journal_queue, &entry, pdMS_TO_TICKS(JOURNAL_POLL_MS)) == pdTRUE) {
+            err = journal_append(&journal, entry.type, entry.timestamp_ms, entry.payload, entry.length);
+            if(err != JOURNAL_OK && !journalRecover(err, "append", &flash_errors)) {
+                break;
+            }
+        }
+
+        if(xTaskGetTickCount() - last_flush >= pdMS_TO_TICKS(JOURNAL_FLUSH_INTERVAL_MS)) {
+            err = journal_flush(&journal);
+            last_flush = xTaskGetTickCount();
+            if(err != JOURNAL_OK && !journalRecover(err, "flush", &flash_errors)) {
+                break;
+            }
+            if(journal_dropped != 0) {
+                printf("Journal queue full. %lu entries dropped so far.\n", (unsigned long)journal_dropped);
+            }
+        }
+
+        /* A good program ends a run of failures. Remounting resets the count to 0. */
+        if(journal.stats.pages_programmed != pages_programmed) {
+            if(journal.stats.pages_programmed > pages_programmed) {
+                flash_errors = 0;
+            }
+            pages_programmed = journal.stats.pages_programmed;
+        }
+    }
+
+    /* Entries still queued are dropped. journalLog() stops queueing new ones. */
+    journal_stopped = true;
+    printf("Journal stopped after %lu flash errors. Events are no longer saved.\n", (unsigned long)flash_errors);
+    vTaskDelete(NULL);
+}
+
+bool initJournal() {
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_PARTITION_SUBTYPE, JOURNAL_PARTITION_LABEL);
+
+    if(partition == NULL) {
+        printf("\nJournal partition not found. Events will not be saved.\n");
+        return false;
+    }
+
+    const journal_flash_t flash = {
+        .ctx = (void *)partition,
+        .read = journalFlashRead,
+        .write = journalFlashWrite,
+        .erase_sector = journalFlashErase,
+        .size = partition->size,
+        .sector_size = partition->erase_size
+    };
+
+    int64_t start = esp_timer_get_time();
+    journal_err_t err = journal_mount(&journal, &flash);
+
+    if(err != JOURNAL_OK) {
+        printf("\nJournal mount failed (%d).\n", err);
+        return false;
+    }
+
+    printf("\nJournal mounted in %lld us: %lu segments, head #%lu, next record #%lu, %lu bytes read.\n",
+           esp_timer_get_time() - start, (unsigned long)journal.segment_count, (unsigned long)journal.head_seq,
+           (unsigned long)journal.next_record_seq, (unsigned long)journal.stats.mount_bytes_read);
+
+    journal_queue = xQueueCreate(JOURNAL_QUEUE_LENGTH, sizeof(journal_entry_t));
+    if(journal_queue == NULL) {
+        return false;
+    }
+
+    return xTaskCreate(journalTask, "journal", JOURNAL_TASK_STACK_SIZE, NULL, JOURNAL_TASK_PRIORITY, NULL) == pdPASS;
+}
+
+/* Safe to call from the receive callback. Never blocks. */
+void journalLog(uint8_t type, const uint8_t *mac, const void *data, size_t data_len) {
+    journal_entry_t entry;
+
+    if(journal_queue == NULL || journal_stopped) {
+        return;
+    }
+
+    if(data_len > sizeof(entry.payload) - JOURNAL_MAC_LEN) {
+        data_len = sizeof(entry.payload) - JOURNAL_MAC_LEN; /* Frames are truncated, never dropped. */
+    }
+
+    entry.type = type;
+    entry.length = JOURNAL_MAC_LEN + data_len;
+    entry.timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    memcpy(entry.payload, mac, JOURNAL_MAC_LEN);
+    memcpy(entry.payload + JOURNAL_MAC_LEN, data, data_len);
+
+    if(xQueueSend(journal_queue, &entry, 0) != pdTRUE) {
+        ++journal_dropped;
+    }
+}
+
+void journalLogEvent(const uint8_t *mac, journal_event_t event, uint8_t channel) {
+    const uint8_t data[2] = {(uint8_t)event, channel};
+    journalLog(JOURNAL_REC_EVENT, mac, data, sizeof(data));
+}
+
 /* Send callback function. */
 
 void onSent(const esp_now_send_info_t *peer_info, esp_now_send_status_t status) {
@@ -86,10 +311,30 @@ void onSent(const esp_now_send_info_t *peer_info, esp_now_send_status_t status)
 
 void onReceived(const esp_now_recv_info_t *peer_info, const uint8_t *data_received, int data_len) {
     esp_message *msg = (esp_message *)data_received;
+    size_t header_len;
+
+    if(data_len < 1) {
+        return;
+    }
+
+    journalLog(JOURNAL_REC_FRAME, peer_info->src_addr, data_received, data_len);
+
+    /* Fields come straight from the radio. Reject frames too short to hold the fixed part. */
+    header_len = msg->flag == SENSOR_READ_BATCH ? offsetof(esp_batch_message, message) : offsetof(esp_message, message);
+    if((size_t)data_len < header_len) {
+        printf("\nDropped %d byte frame from " MACSTR ": too short for flag %u.\n", data_len, MAC2STR(peer_info->src_addr), msg->flag);
+        return;
+    }
+
+    /* Text may be cut short or unterminated. Never print past the frame or the message field. */
+    int text_len = data_len - (int)header_len;
+    if(text_len > (int)sizeof(msg->message)) {
+        text_len = sizeof(msg->message);
+    }
 
     printf("\nReceived from:\n");
     printf("Sender MAC address: " MACSTR "\n", MAC2STR(peer_info->src_addr));
-    printf("Message flag: %s\n", msg->flag == NORMAL_MESSAGE ? "Normal" : msg->flag == SENSOR_READ ? "Sensor Read" : "ERROR_BROADCAST");
+    printf("Message flag: %s\n", msg->flag == NORMAL_MESSAGE ? "Normal" : msg->flag == SENSOR_READ ? "Sensor Read" : msg->flag == SENSOR_READ_BATCH ? "Sensor Read Batch" : "ERROR_BROADCAST");
     printf("Message length: %d\n", data_len);  
     printf("Message: \n");
     
@@ -97,20 +342,45 @@ void onReceived(const esp_now_recv_info_t *peer_info, const uint8_t *data_receiv
         bool sensor_status = msg->sensor_read_level;
         printf("Beam status: %s.\n", sensor_status == HIGH ? "Unbroken" : "Broken");
         if(sensor_status == HIGH) { /* Beam is not broken. No mail in the mailbox!. */
+            journalLogEvent(peer_info->src_addr, JOURNAL_EVENT_MAILBOX_EMPTIED, 0);
             gpio_set_level(RED_LED_PIN, LOW);
             gpio_set_level(GREEN_LED_PIN, HIGH);
         }
         else { /* Beam broken. There is mail in the mailbox. */
+            journalLogEvent(peer_info->src_addr, JOURNAL_EVENT_MAIL_ARRIVED, 0);
+            gpio_set_level(RED_LED_PIN, HIGH);
+            gpio_set_level(GREEN_LED_PIN, LOW);
+        }
+    }
+    else if(msg->flag == SENSOR_READ_BATCH) {
+        esp_batch_message *batch = (esp_batch_message *)data_received;
+        uint8_t channel_count = batch->channel_count < MAX_SENSOR_CHANNELS ? batch->channel_count : MAX_SENSOR_CHANNELS;
+        uint8_t all_channels = (uint8_t)((1U << channel_count) - 1);
+
+        for(uint8_t i = 0; i < channel_count; ++i) {
+            bool beam_unbroken = batch->beam_levels & (1U << i);
+            printf("Channel %u beam status: %s.%s\n", i, beam_unbroken ? "Unbroken" : "Broken", batch->changed & (1U << i) ? " (changed)" : "");
+            if(batch->changed & (1U << i)) {
+                journalLogEvent(peer_info->src_addr, beam_unbroken ? JOURNAL_EVENT_MAILBOX_EMPTIED : JOURNAL_EVENT_MAIL_ARRIVED, i);
+            }
+        }
+
+        if((batch->beam_levels & all_channels) == all_channels) { /* Every beam unbroken. No mail in any mailbox. */
+            gpio_set_level(RED_LED_PIN, LOW);
+            gpio_set_level(GREEN_LED_PIN, HIGH);
+        }
+        else { /* At least one mailbox has mail. */
             gpio_set_level(RED_LED_PIN, HIGH);
             gpio_set_level(GREEN_LED_PIN, LOW);
         }
     }
     else if(msg->flag == ERROR_BROADCAST) {
+        journalLogEvent(peer_info->src_addr, JOURNAL_EVENT_SLAVE_ERROR, 0);
         gpio_set_level(RED_LED_PIN, HIGH);
         gpio_set_level(GREEN_LED_PIN, HIGH);
     }
   
-    printf("Rest of the message: %s.\n\n", msg->message); // Skip the first byte which contains non-message info.
+    printf("Rest of the message: %.*s.\n\n", text_len, (const char *)data_received + header_len); // Skip the bytes which contain non-message info.
 
     
 } // End of onReceived().
@@ -123,6 +393,13 @@ int message_count = 0;
 
 uint8_t num = 1;
 void app_main() {
+    uint8_t own_mac[ESP_NOW_ETH_ALEN];
+
+    // Mount the journal and start its task before ESP-NOW so no received frame is missed.
+    if(initJournal()) {
+        esp_read_mac(own_mac, ESP_MAC_WIFI_STA);
+        journalLogEvent(own_mac, JOURNAL_EVENT_BOOT, 0);
+    }
    
     // Init wifi and esp_now.
     if(initWiFi() && initESPNOW()) {
@@ -0,0 +1,131 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: File-backed NOR flash stand-in for running the journal on a host.
+
+Programming can only clear bits, like real flash, and erase sets a whole
+sector back to 0xFF. Faults are injected with write_budget (power lost in the
+middle of a page program) and drop_writes (program reported done but never
+reached the chip). Pages programmed twice without an erase are counted.
+*/
+
+#ifndef FILE_FLASH_H
+#define FILE_FLASH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "journal.h"
+
+typedef struct file_flash {
+    FILE *file;
+    uint32_t size;
+    uint32_t sector_size;
+    int32_t write_budget; /* Bytes that can still be programmed. -1 for no limit. */
+    bool drop_writes;
+    uint8_t *page_programs; /* Program count per page since its last erase. */
+    uint32_t double_programs;
+} file_flash_t;
+
+static int fileFlashRead(void *ctx, uint32_t addr, void *buf, size_t len) {
+    file_flash_t *flash = ctx;
+
+    if(addr + len > flash->size || fseek(flash->file, addr, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fread(buf, 1, len, flash->file) == len ? 0 : -1;
+}
+
+static int fileFlashWrite(void *ctx, uint32_t addr, const void *buf, size_t len) {
+    file_flash_t *flash = ctx;
+    const uint8_t *src = buf;
+
+    if(addr + len > flash->size) {
+        return -1;
+    }
+
+    if(flash->drop_writes) {
+        return 0; /* Power was lost before the program started. The chip is untouched. */
+    }
+
+    for(uint32_t page = addr / JOURNAL_PAGE_SIZE; page <= (addr + len - 1) / JOURNAL_PAGE_SIZE; ++page) {
+        if(flash->page_programs[page]++ != 0) {
+            ++flash->double_programs;
+        }
+    }
+
+    size_t landed = len;
+    if(flash->write_budget >= 0 && (size_t)flash->write_budget < len) {
+        landed = flash->write_budget; /* Torn: only the first bytes land. */
+    }
+
+    uint8_t cells[JOURNAL_PAGE_SIZE];
+    for(size_t done = 0; done < landed; done += sizeof(cells)) {
+        size_t chunk = landed - done < sizeof(cells) ? landed - done : sizeof(cells);
+
+        fileFlashRead(flash, addr + done, cells, chunk);
+        for(size_t i = 0; i < chunk; ++i) {
+            cells[i] &= src[done + i]; /* NOR flash can only clear bits. */
+        }
+        fseek(flash->file, addr + done, SEEK_SET);
+        fwrite(cells, 1, chunk, flash->file);
+    }
+
+    if(landed < len) {
+        flash->write_budget = 0;
+        return -1;
+    }
+    if(flash->write_budget > 0) {
+        flash->write_budget -= len;
+    }
+    return 0;
+}
+
+static int fileFlashErase(void *ctx, uint32_t addr) {
+    file_flash_t *flash = ctx;
+    uint8_t erased[JOURNAL_PAGE_SIZE];
+
+    if(addr % flash->sector_size != 0 || addr + flash->sector_size > flash->size) {
+        return -1;
+    }
+
+    memset(erased, 0xFF, sizeof(erased));
+    fseek(flash->file, addr, SEEK_SET);
+    for(uint32_t i = 0; i < flash->sector_size; i += JOURNAL_PAGE_SIZE) {
+        fwrite(erased, 1, sizeof(erased), flash->file);
+    }
+    memset(flash->page_programs + addr / JOURNAL_PAGE_SIZE, 0, flash->sector_size / JOURNAL_PAGE_SIZE);
+    return 0;
+}
+
+/* Creates a blank (all 0xFF) flash backed by a temporary file. */
+static void fileFlashOpen(file_flash_t *flash, uint32_t size, uint32_t sector_size) {
+    memset(flash, 0, sizeof(*flash));
+    flash->file = tmpfile();
+    flash->size = size;
+    flash->sector_size = sector_size;
+    flash->write_budget = -1;
+    flash->page_programs = calloc(size / JOURNAL_PAGE_SIZE, 1);
+
+    for(uint32_t addr = 0; addr < size; addr += sector_size) {
+        fileFlashErase(flash, addr);
+    }
+}
+
+static void fileFlashClose(file_flash_t *flash) {
+    fclose(flash->file);
+    free(flash->page_programs);
+}
+
+static journal_flash_t fileFlashJournal(file_flash_t *flash) {
+    const journal_flash_t journal_flash = {
+        .ctx = flash,
+        .read = fileFlashRead,
+        .write = fileFlashWrite,
+        .erase_sector = fileFlashErase,
+        .size = flash->size,
+        .sector_size = flash->sector_size
+    };
+    return journal_flash;
+}
+
+#endif /* FILE_FLASH_H */
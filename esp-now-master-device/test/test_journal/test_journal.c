@@ -0,0 +1,283 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Host tests for the event journal against a file-backed flash.
+Run with: pio test -e native
+*/
+
+#include <unity.h>
+#include "journal.h"
+#include "../file_flash.h"
+
+#define FLASH_SIZE (64 * 1024)
+#define SECTOR_SIZE 4096
+
+typedef struct export_check {
+    uint32_t count;
+    uint32_t first_seq;
+    uint32_t last_seq;
+    bool contiguous;
+    bool payload_ok;
+} export_check_t;
+
+static file_flash_t flash;
+static journal_flash_t jflash;
+static journal_t journal;
+
+
+void setUp(void) {
+    fileFlashOpen(&flash, FLASH_SIZE, SECTOR_SIZE);
+    jflash = fileFlashJournal(&flash);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_mount(&journal, &jflash));
+}
+
+void tearDown(void) {
+    TEST_ASSERT_EQUAL_UINT32(0, flash.double_programs);
+    fileFlashClose(&flash);
+}
+
+/* Payload of record n is (n % 40) + 1 bytes, each equal to (uint8_t)n. */
+static size_t fillPayload(uint32_t n, uint8_t *payload) {
+    size_t len = (n % 40) + 1;
+    memset(payload, (uint8_t)n, len);
+    return len;
+}
+
+static void appendRecords(uint32_t count, uint32_t flush_every) {
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t n = journal.next_record_seq;
+        size_t len = fillPayload(n, payload);
+        TEST_ASSERT_EQUAL(JOURNAL_OK, journal_append(&journal, JOURNAL_REC_FRAME, n * 10, payload, len));
+        if(flush_every != 0 && (i + 1) % flush_every == 0) {
+            TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+        }
+    }
+}
+
+static bool checkRecord(void *ctx, const journal_record_t *record) {
+    export_check_t *check = ctx;
+    uint8_t expected[JOURNAL_MAX_PAYLOAD];
+    size_t len = fillPayload(record->header.seq, expected);
+
+    if(check->count == 0) {
+        check->first_seq = record->header.seq;
+    }
+    else if(record->header.seq != check->last_seq + 1) {
+        check->contiguous = false;
+    }
+
+    if(record->header.length != len || memcmp(record->payload, expected, len) != 0 ||
+       record->header.timestamp_ms != record->header.seq * 10) {
+        check->payload_ok = false;
+    }
+
+    check->last_seq = record->header.seq;
+    ++check->count;
+    return true;
+}
+
+static export_check_t exportAll(void) {
+    export_check_t check = { .contiguous = true, .payload_ok = true };
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_export(&journal, checkRecord, &check));
+    TEST_ASSERT_TRUE(check.contiguous);
+    TEST_ASSERT_TRUE(check.payload_ok);
+    return check;
+}
+
+static void remount(void) {
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_mount(&journal, &jflash));
+}
+
+
+void test_append_and_export(void) {
+    appendRecords(50, 7);
+
+    export_check_t check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(50, check.count);
+    TEST_ASSERT_EQUAL_UINT32(0, check.first_seq);
+    TEST_ASSERT_EQUAL_UINT32(49, check.last_seq);
+}
+
+void test_only_whole_pages_are_programmed(void) {
+    appendRecords(200, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+
+    TEST_ASSERT_EQUAL_UINT32(journal.stats.pages_programmed * JOURNAL_PAGE_SIZE, journal.stats.bytes_programmed);
+    TEST_ASSERT_TRUE(journal.stats.bytes_programmed >= journal.stats.bytes_appended);
+}
+
+void test_remount_resumes_sequence(void) {
+    appendRecords(30, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+
+    remount();
+    TEST_ASSERT_EQUAL_UINT32(30, journal.next_record_seq);
+
+    appendRecords(30, 4);
+    export_check_t check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(60, check.count);
+    TEST_ASSERT_EQUAL_UINT32(59, check.last_seq);
+}
+
+void test_wrap_drops_oldest_segments(void) {
+    appendRecords(5000, 0);
+
+    export_check_t check = exportAll();
+    TEST_ASSERT_TRUE(check.first_seq > 0);
+    TEST_ASSERT_EQUAL_UINT32(4999, check.last_seq);
+    TEST_ASSERT_TRUE(journal.stats.sectors_erased > journal.segment_count);
+
+    remount();
+    check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(4999, check.last_seq);
+    TEST_ASSERT_EQUAL_UINT32(5000, journal.next_record_seq);
+}
+
+void test_unflushed_records_are_lost_on_reset(void) {
+    appendRecords(20, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+    appendRecords(3, 0); /* Still in the page buffer. */
+
+    remount();
+    TEST_ASSERT_EQUAL_UINT32(20, journal.next_record_seq);
+
+    appendRecords(10, 0);
+    export_check_t check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(30, check.count);
+}
+
+void test_torn_write_is_dropped(void) {
+    appendRecords(40, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+
+    flash.write_budget = 100; /* Power lost 100 bytes into the next page. */
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    while(journal_append(&journal, JOURNAL_REC_FRAME, journal.next_record_seq * 10, payload,
+                         fillPayload(journal.next_record_seq, payload)) == JOURNAL_OK) {
+    }
+    flash.write_budget = -1;
+
+    remount();
+    export_check_t check = exportAll();
+    TEST_ASSERT_TRUE(check.last_seq >= 39);
+    TEST_ASSERT_EQUAL_UINT32(check.last_seq + 1, journal.next_record_seq);
+
+    appendRecords(20, 5);
+    check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(journal.next_record_seq - 1, check.last_seq);
+}
+
+void test_lost_segment_header_program(void) {
+    /* Fill the first segment, then lose the page that would carry the next segment's header. */
+    appendRecords(1, 0);
+    while(journal.head_index == 0) {
+        appendRecords(1, 0);
+    }
+    flash.drop_writes = true;
+    appendRecords(5, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+    flash.drop_writes = false;
+
+    remount();
+    TEST_ASSERT_EQUAL_UINT32(0, journal.head_index);
+
+    uint32_t resume_seq = journal.next_record_seq;
+    appendRecords(10, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+
+    export_check_t check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(0, check.first_seq);
+    TEST_ASSERT_EQUAL_UINT32(resume_seq + 9, check.last_seq);
+}
+
+void test_write_error_skips_failed_page(void) {
+    appendRecords(40, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+    uint32_t durable = journal.next_record_seq;
+
+    /* One program fails 10 bytes in, then the flash works again. */
+    flash.write_budget = 10;
+    uint8_t payload[JOURNAL_MAX_PAYLOAD];
+    journal_err_t err;
+    do {
+        uint32_t seq = journal.next_record_seq;
+        err = journal_append(&journal, JOURNAL_REC_FRAME, seq * 10, payload, fillPayload(seq, payload));
+    } while(err == JOURNAL_OK);
+    flash.write_budget = -1;
+
+    TEST_ASSERT_EQUAL(JOURNAL_ERR_FLASH, err);
+    TEST_ASSERT_EQUAL_UINT32(1, journal.stats.write_errors);
+    TEST_ASSERT_EQUAL_UINT32(0, journal.page_fill); /* No half record left behind. */
+
+    uint32_t resume_seq = journal.next_record_seq;
+    appendRecords(30, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+    TEST_ASSERT_EQUAL_UINT32(resume_seq + 30, journal.next_record_seq);
+
+    /* Records staged in the failed page are gone. Everything before and after it is readable. */
+    export_check_t check = { .contiguous = true, .payload_ok = true };
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_export(&journal, checkRecord, &check));
+    TEST_ASSERT_TRUE(check.payload_ok);
+    TEST_ASSERT_EQUAL_UINT32(0, check.first_seq);
+    TEST_ASSERT_EQUAL_UINT32(resume_seq + 29, check.last_seq);
+    TEST_ASSERT_TRUE(check.count >= durable + 30);
+
+    remount();
+    TEST_ASSERT_EQUAL_UINT32(resume_seq + 30, journal.next_record_seq);
+}
+
+void test_corrupt_record_ends_segment(void) {
+    appendRecords(10, 0);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+
+    /* Clear one set bit in the CRC of the first record, as a bad program would. */
+    uint8_t byte;
+    uint32_t addr = sizeof(journal_segment_header_t) + offsetof(journal_record_header_t, crc);
+    fileFlashRead(&flash, addr, &byte, 1);
+    TEST_ASSERT_TRUE(byte != 0);
+    byte &= (uint8_t)(byte - 1);
+    fseek(flash.file, addr, SEEK_SET);
+    fwrite(&byte, 1, 1, flash.file);
+
+    remount();
+    TEST_ASSERT_EQUAL_UINT32(0, journal.next_record_seq);
+
+    appendRecords(5, 0);
+    export_check_t check = exportAll();
+    TEST_ASSERT_EQUAL_UINT32(5, check.count);
+    TEST_ASSERT_EQUAL_UINT32(1, journal.head_index); /* Rest of the damaged segment was abandoned. */
+}
+
+void test_rejects_oversized_payload(void) {
+    uint8_t payload[JOURNAL_MAX_PAYLOAD + 1] = {0};
+    TEST_ASSERT_EQUAL(JOURNAL_ERR_ARG, journal_append(&journal, JOURNAL_REC_FRAME, 0, payload, sizeof(payload)));
+}
+
+void test_rejects_bad_geometry(void) {
+    journal_flash_t bad = jflash;
+    bad.sector_size = 1000;
+    TEST_ASSERT_EQUAL(JOURNAL_ERR_ARG, journal_mount(&journal, &bad));
+
+    bad = jflash;
+    bad.size = SECTOR_SIZE;
+    TEST_ASSERT_EQUAL(JOURNAL_ERR_ARG, journal_mount(&journal, &bad));
+    remount();
+}
+
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_append_and_export);
+    RUN_TEST(test_only_whole_pages_are_programmed);
+    RUN_TEST(test_remount_resumes_sequence);
+    RUN_TEST(test_wrap_drops_oldest_segments);
+    RUN_TEST(test_unflushed_records_are_lost_on_reset);
+    RUN_TEST(test_torn_write_is_dropped);
+    RUN_TEST(test_lost_segment_header_program);
+    RUN_TEST(test_write_error_skips_failed_page);
+    RUN_TEST(test_corrupt_record_ends_segment);
+    RUN_TEST(test_rejects_oversized_payload);
+    RUN_TEST(test_rejects_bad_geometry);
+    return UNITY_END();
+}
@@ -0,0 +1,108 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Write amplification and recovery cost benchmarks for the event journal.
+Uses the same geometry as the journal partition. Prints the numbers and fails
+when they cross the limits below.
+Run with: pio test -e native -f test_journal_bench -v
+*/
+
+#include <time.h>
+#include <unity.h>
+#include "journal.h"
+#include "../file_flash.h"
+
+#define FLASH_SIZE (512 * 1024) /* Same as the journal partition in partitions.csv. */
+#define SECTOR_SIZE 4096
+#define RECORD_COUNT 40000 /* Enough to wrap the ring several times. */
+
+#define EVENT_PAYLOAD 8 /* MAC + event + channel. */
+#define FRAME_PAYLOAD 62 /* MAC + a typical esp_batch_message. */
+
+/* Limits. bytes_programmed / bytes_appended. */
+#define MAX_WA_PAGE_BATCHED 1.10
+#define MAX_WA_FLUSH_EVERY_10 1.75
+/* Headers of every segment plus one full segment scan. */
+#define MAX_MOUNT_BYTES_READ ((FLASH_SIZE / SECTOR_SIZE) * sizeof(journal_segment_header_t) + 2 * SECTOR_SIZE)
+
+static file_flash_t flash;
+static journal_flash_t jflash;
+static journal_t journal;
+
+
+void setUp(void) {
+    fileFlashOpen(&flash, FLASH_SIZE, SECTOR_SIZE);
+    jflash = fileFlashJournal(&flash);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_mount(&journal, &jflash));
+}
+
+void tearDown(void) {
+    fileFlashClose(&flash);
+}
+
+/* Alternates event and frame records like the master does, flushing every flush_every records (0: never). */
+static double runWorkload(const char *name, uint32_t flush_every) {
+    uint8_t payload[FRAME_PAYLOAD] = {0};
+    char line[160];
+
+    for(uint32_t i = 0; i < RECORD_COUNT; ++i) {
+        size_t len = (i % 2 == 0) ? FRAME_PAYLOAD : EVENT_PAYLOAD;
+        payload[0] = (uint8_t)i;
+        TEST_ASSERT_EQUAL(JOURNAL_OK, journal_append(&journal, JOURNAL_REC_FRAME, i, payload, len));
+        if(flush_every != 0 && (i + 1) % flush_every == 0) {
+            TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+        }
+    }
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_flush(&journal));
+    TEST_ASSERT_EQUAL_UINT32(0, flash.double_programs);
+
+    double wa = (double)journal.stats.bytes_programmed / journal.stats.bytes_appended;
+    snprintf(line, sizeof(line), "%s: write amplification %.3f, %lu pages, %lu erases (%.1f per segment)",
+             name, wa, (unsigned long)journal.stats.pages_programmed, (unsigned long)journal.stats.sectors_erased,
+             (double)journal.stats.sectors_erased / journal.segment_count);
+    TEST_MESSAGE(line);
+    return wa;
+}
+
+
+void test_write_amplification_page_batched(void) {
+    TEST_ASSERT_TRUE(runWorkload("page batched", 0) <= MAX_WA_PAGE_BATCHED);
+}
+
+void test_write_amplification_flush_every_10(void) {
+    TEST_ASSERT_TRUE(runWorkload("flush every 10", 10) <= MAX_WA_FLUSH_EVERY_10);
+}
+
+void test_write_amplification_flush_every_record(void) {
+    /* Worst case: every record pads out a page. Reported, bounded by one page per record. */
+    double wa = runWorkload("flush every record", 1);
+    TEST_ASSERT_TRUE(wa <= (double)JOURNAL_PAGE_SIZE / (sizeof(journal_record_header_t) + EVENT_PAYLOAD));
+}
+
+void test_recovery_cost_full_journal(void) {
+    char line[160];
+    struct timespec start, end;
+
+    runWorkload("recovery fill", 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL(JOURNAL_OK, journal_mount(&journal, &jflash));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    snprintf(line, sizeof(line), "recovery: %lu bytes read of %u (%.2f%%), %.1f us on host",
+             (unsigned long)journal.stats.mount_bytes_read, FLASH_SIZE, 100.0 * journal.stats.mount_bytes_read / FLASH_SIZE,
+             (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3);
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_EQUAL_UINT32(RECORD_COUNT, journal.next_record_seq);
+    TEST_ASSERT_TRUE(journal.stats.mount_bytes_read <= MAX_MOUNT_BYTES_READ);
+}
+
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_write_amplification_page_batched);
+    RUN_TEST(test_write_amplification_flush_every_10);
+    RUN_TEST(test_write_amplification_flush_every_record);
+    RUN_TEST(test_recovery_cost_full_journal);
+    return UNITY_END();
+}
@@ -9,13 +9,24 @@ Purpose: This source code is meant to be uploaded to Master ESP32 device.
 #include <esp_event.h>
 #include <nvs_flash.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <esp_mac.h>
 #include <string.h>
 #include <driver/gpio.h>
 #include <driver/rtc_io.h>
 #include <esp_sleep.h>
+#include <esp_timer.h>
+#include <sys/time.h>
+#include <soc/soc.h>
+#include <soc/gpio_reg.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
 
 #include "../../misc-headers/esp-now-message-struct.h"
+#include "sensor_channels.h"
+#include "power_model.h"
+#include "slave_logic.h"
 
 
 #define MAGIC_NUMBER 0xDEADBEEF
@@ -23,47 +34,32 @@ Purpose: This source code is meant to be uploaded to Master ESP32 device.
 #define TEST_CHANNEL 6
 #define LOW 0
 #define HIGH 1
-#define RELEASE_BUILD_SLEEP_TIME 43200000000 /* 43,200,000,000 == 12 hours. */
-#define TEST_BUILD_SLEEP_TIME 5000000 /* 5000000 == 5 seconds. */
-
-/* Sleeping times. */
-#define TEST_INITIAL_SLEEP_TIME 5000000 /* 5000000 == 5 seconds. */
-#define TEST_PIR_START_UP_SLEEP_TIME 60000000 /* 60000000 == 60 seconds. */
-#define TEST_FIRST_MOTION_DETECTED_SLEEP_TIME 5000000 /* 5000000 == 5 seconds. */
-#define TEST_IR_BEAM_PULSE_INTERVAL 5000000 /* 5000000 == 5 seconds. */
 
 /* RTC capable pins. */
-/* IR emitter and sensor pins. */
+/* IR emitter and sensor pins. The transistors power the emitters and sensors of every channel. */
 #define IR_SENSOR_READ_PIN 25
 #define IR_SENSOR_TRANSISTOR_PIN 26
 #define IR_EMITTER_TRANSISTOR_PIN 27
 #define IR_SENSOR_READ_DELAY 5 /* 1s. */
 
-/* PIR pins. */
+/* PIR pins. The transistor powers the PIRs of every channel. */
 #define PIR_TRANSISTOR_PIN 32
 #define PIR_READ_PIN 33
 
-#define MAX_PULSE_COUNT 3
-
-
-typedef enum device_state {
-    INITIAL_READ, /* Wakeup source: Timer. */
-    PIR_READY, /* Sleep until first motion detected. Wakeup source: PIR_READ_PIN. */
-    RETRIEVAL_PHASE, /* Sleep to give user time to empty mailbox. Wakeup source: Timer. */
-    IR_BEAM_PULSE /* For beam pulse intervals. Wakeup source: Timer.*/
-} device_state_t;
+/* Power accounting. */
+#ifndef POWER_DEBUG
+#define POWER_DEBUG 0 /* 1: print the battery projection before every sleep. Float printf costs awake time. */
+#endif
 
 
-typedef enum sleep_mode {
-    SLEEP_INITIAL_TIME,
-    SLEEP_PIR_START_UP_TIME,
-    SLEEP_AWAIT_MOTION,
-    SLEEP_RETRIEVAL_TIME,
-    SLEEP_IR_BEAM_PULSE_TIME
-} sleep_mode_t;
+/* ESP-NOW calls onSent() once for every accepted send, in order, so the n-th status belongs to send n. */
+typedef struct send_status {
+    uint32_t send_number;
+    esp_now_send_status_t status;
+} send_status_t;
 
 typedef struct saved_state {
-    device_state_t state;
+    slave_state_t slave;
     uint32_t magicNumber;
 } saved_state_t;
 
@@ -74,12 +70,42 @@ void onReceived(const esp_now_recv_info_t *peer_info, const uint8_t *data_receiv
 
 /* Global variables. */
 esp_netif_t *netif_wifi_sta;
+QueueHandle_t send_status_queue; /* Holds the status of the last send, posted by onSent(). */
+uint32_t sends_queued = 0; /* esp_now_send() calls accepted by the driver. Numbers each send from 1. */
 RTC_NOINIT_ATTR saved_state_t next_phase; /* Used for checkpoints due to RTC_NOINIT_ATTR. */
-RTC_SLOW_ATTR uint8_t pulse_counter = 0;
+
+RTC_SLOW_ATTR power_ledger_t power_ledger; /* Time counted in each power state since power on. */
+RTC_SLOW_ATTR int64_t sleep_started_us = 0; /* 0 until the first deep sleep. */
+RTC_SLOW_ATTR int64_t pir_on_since_us = 0; /* PIR stays powered across deep sleeps. */
+int64_t radio_on_since_us = 0;
+const power_profile_t power_profile = POWER_PROFILE_DEFAULT;
+
+#ifdef RELEASE_BUILD
+const slave_timing_t slave_timing = SLAVE_TIMING_RELEASE;
+#else
+const slave_timing_t slave_timing = SLAVE_TIMING_TEST;
+#endif
+
+/* Hard-coded for test. But in release, this must still be
+   known ahead of time if broadcast is not used to acquire it.
+*/
+const uint8_t master_mac_addr[ESP_NOW_ETH_ALEN] = {0x88, 0x13, 0xbf, 0x0b, 0xe1, 0x50};
 
 //  saved_state_t next_phase; /* Used for checkpoints due to RTC_NOINIT_ATTR. */
 //  uint8_t pulse_counter = 0;
 
+/* One row per mailbox. Every PIR read pin must be RTC capable for ext1 wakeup.
+   IR read pins use the internal pull-up, so they cannot be GPIO34-39. */
+const sensor_channel_t sensor_channels[] = {
+    { .ir_read_pin = IR_SENSOR_READ_PIN, .pir_read_pin = PIR_READ_PIN },
+    // { .ir_read_pin = 4, .pir_read_pin = 34 },
+    // { .ir_read_pin = 13, .pir_read_pin = 35 },
+};
+
+#define SENSOR_CHANNEL_COUNT (sizeof(sensor_channels) / sizeof(sensor_channels[0]))
+/* Driven as outputs, so no channel may read from them. */
+#define TRANSISTOR_PINS (SENSOR_PIN_BIT(IR_SENSOR_TRANSISTOR_PIN) | SENSOR_PIN_BIT(IR_EMITTER_TRANSISTOR_PIN) | SENSOR_PIN_BIT(PIR_TRANSISTOR_PIN))
+
 
 /********** ESP-NOW Component setup start. **********/
 bool initWiFi() {
@@ -114,6 +140,12 @@ bool initESPNOW() {
 
     ESP_ERROR_CHECK(esp_now_init());
 
+    send_status_queue = xQueueCreate(1, sizeof(send_status_t));
+    if(send_status_queue == NULL) {
+        printf("Could not create send status queue!\n");
+        return false;
+    }
+
     /* Register callback functions. */
     ESP_ERROR_CHECK(esp_now_register_send_cb(onSent));
     ESP_ERROR_CHECK(esp_now_register_recv_cb(onReceived));
@@ -125,6 +157,7 @@ bool initESPNOW() {
 
 void setupComponents(const uint8_t *master_mac_addr, const uint8_t wifi_channel) {
     printf("setup() call entry...\n");
+    radio_on_since_us = esp_timer_get_time();
     
     // Init wifi and esp_now.
     if(initWiFi() && initESPNOW()) {
@@ -146,24 +179,68 @@ void setupComponents(const uint8_t *master_mac_addr, const uint8_t wifi_channel)
 /********** ESP-NOW Component setup end. **********/
 
 
+/********** Power accounting start. **********/
+/* Wall clock in microseconds. Kept by the RTC timer through deep sleep, unlike esp_timer_get_time(). */
+int64_t nowUs() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+} /* End of nowUs(). */
+
+/* Deep sleep time is the wall clock gap since the last sleep, minus the boot of this wake. */
+void powerAccountWake() {
+    ++power_ledger.wakes;
+    if(sleep_started_us != 0) {
+        powerLedgerAdd(&power_ledger, POWER_DEEP_SLEEP, nowUs() - sleep_started_us - esp_timer_get_time() - POWER_BOOT_OVERHEAD_US);
+    }
+} /* End of powerAccountWake(). */
+
+void powerAccountSleep() {
+    int64_t awake_us = esp_timer_get_time();
+
+    if(radio_on_since_us != 0) {
+        powerLedgerAdd(&power_ledger, POWER_RADIO_RX, awake_us - radio_on_since_us);
+    }
+    powerLedgerAdd(&power_ledger, POWER_CPU_AWAKE, awake_us + POWER_BOOT_OVERHEAD_US);
+
+#if POWER_DEBUG
+    printf("Power: %u wakes, %u sends (%u not delivered), %u events, %.4f mAh over %.2f h.\n",
+           (unsigned)power_ledger.wakes, (unsigned)power_ledger.tx_attempts, (unsigned)power_ledger.delivery_failures,
+           (unsigned)power_ledger.events,
+           powerChargeMah(&power_ledger, &power_profile), powerElapsedHours(&power_ledger));
+    printf("Projected battery life: %.1f days. %.4f mAh per mailbox event.\n",
+           powerProjectedDays(&power_ledger, &power_profile), powerChargePerEventMah(&power_ledger, &power_profile));
+#endif
+
+    sleep_started_us = nowUs();
+} /* End of powerAccountSleep(). */
+/********** Power accounting end. **********/
+
+
 /********** Pin configurations start. **********/
 void irPinConfig() { 
     printf("irPinConfig() call entry...\n");
         
-    const gpio_config_t cfg = {
-        .pin_bit_mask = (1ULL << IR_SENSOR_READ_PIN | 1ULL << IR_SENSOR_TRANSISTOR_PIN | 1ULL << IR_EMITTER_TRANSISTOR_PIN),
-        .mode = GPIO_MODE_OUTPUT, /* Make sure to change IR_SENSOR_READ_PIN to input. */
+    const gpio_config_t power_cfg = {
+        .pin_bit_mask = (1ULL << IR_SENSOR_TRANSISTOR_PIN | 1ULL << IR_EMITTER_TRANSISTOR_PIN),
+        .mode = GPIO_MODE_OUTPUT,
         .intr_type = GPIO_INTR_DISABLE
     };
-    gpio_config(&cfg);
+    gpio_config(&power_cfg);
 
+    /* Powers every emitter and sensor at once. */
     gpio_set_level(IR_SENSOR_TRANSISTOR_PIN, HIGH);
     gpio_set_level(IR_EMITTER_TRANSISTOR_PIN, HIGH);
 
-    gpio_set_direction(IR_SENSOR_READ_PIN, GPIO_MODE_INPUT); 
-    gpio_pullup_en(IR_SENSOR_READ_PIN);
+    const gpio_config_t read_cfg = {
+        .pin_bit_mask = sensorChannelsIrMask(sensor_channels, SENSOR_CHANNEL_COUNT),
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .intr_type = GPIO_INTR_DISABLE
+    };
+    gpio_config(&read_cfg);
     printf("irPinConfig() call exit...\n");
-} /* End of pinConfig(). */
+} /* End of irPinConfig(). */
 
 void rtc_PirTransistorPinConfig() {
     printf("rtc_PirTransistorPinConfig() call entry...\n");
@@ -171,14 +248,19 @@ void rtc_PirTransistorPinConfig() {
     rtc_gpio_set_direction(PIR_TRANSISTOR_PIN, RTC_GPIO_MODE_OUTPUT_ONLY);
     rtc_gpio_set_level(PIR_TRANSISTOR_PIN, HIGH);
     rtc_gpio_hold_en(PIR_TRANSISTOR_PIN);
+    pir_on_since_us = nowUs();
     printf("rtc_PirTransistorPinConfig() call exit...\n");
 
 } /* End of rtc_PirTransistorPinConfig(). */
 
-void rtc_PirReadPinConfig() {
+void rtc_PirReadPinConfig(uint64_t pir_pin_mask) {
     printf("rtc_PirReadPinConfig() call entry...\n");
-    rtc_gpio_init(PIR_READ_PIN);
-    rtc_gpio_set_direction(PIR_READ_PIN, RTC_GPIO_MODE_INPUT_ONLY);
+    for(int pin = 0; pin < SENSOR_GPIO_PIN_COUNT; ++pin) {
+        if(pir_pin_mask & SENSOR_PIN_BIT(pin)) {
+            rtc_gpio_init(pin);
+            rtc_gpio_set_direction(pin, RTC_GPIO_MODE_INPUT_ONLY);
+        }
+    }
     printf("rtc_PirReadPinConfig() call exit...\n");
 } /* End of rtc_PirReadPinConfig(). */
 
@@ -186,9 +268,15 @@ void rtc_PirTurnOff() {
     printf("rtc_PirTurnOff() call entry...\n");
     rtc_gpio_hold_dis(PIR_TRANSISTOR_PIN);
     rtc_gpio_set_direction(PIR_TRANSISTOR_PIN, RTC_GPIO_MODE_DISABLED);
-    rtc_gpio_set_direction(PIR_READ_PIN, RTC_GPIO_MODE_DISABLED);
     rtc_gpio_deinit(PIR_TRANSISTOR_PIN);
-    rtc_gpio_deinit(PIR_READ_PIN);
+    for(size_t i = 0; i < SENSOR_CHANNEL_COUNT; ++i) {
+        rtc_gpio_set_direction(sensor_channels[i].pir_read_pin, RTC_GPIO_MODE_DISABLED);
+        rtc_gpio_deinit(sensor_channels[i].pir_read_pin);
+    }
+    if(pir_on_since_us != 0) {
+        powerLedgerAdd(&power_ledger, POWER_PIR, nowUs() - pir_on_since_us);
+        pir_on_since_us = 0;
+    }
     printf("rtc_PirTurnOff() call exit...\n");
 } /* End of rtc_PirTurnOff(). */
 
@@ -204,32 +292,34 @@ void turnOffIrPin(uint64_t mask) {
     printf("turnOffIrPin() call exit...\n");
 }/* End of turnOffIrPin(). */
 
-/********** readIrPin() wrapper functions start. **********/
-uint8_t readIrPin() {
-    uint8_t sensor_read_level;
+/********** readIrPins() wrapper functions start. **********/
+/* Returns one level bit per channel. Bit set: beam unbroken. Bit clear: beam broken (mail). */
+uint8_t readIrPins() {
+    uint64_t gpio_snapshot;
+    uint8_t beam_levels;
 
     /* Configure IR pins to be used. */
     printf("\nCalling irPinConfig().\n");
+    int64_t emitter_on_us = esp_timer_get_time();
     irPinConfig();
 
-    printf("\nReading sensor level...\n");
-    sensor_read_level = gpio_get_level(IR_SENSOR_READ_PIN); /* Read sensor state. */
-    printf("Delaying ~5ms to allow IR sensor to process signal...\n");
-   
+    printf("Delaying to allow IR sensors to process signal...\n");
     vTaskDelay(IR_SENSOR_READ_DELAY);
-    printf("Sensor read level: %d.\n", sensor_read_level);    
+
+    /* Every beam in one snapshot of the input registers. GPIO_IN1_REG holds GPIO32-39 in its low byte. */
+    printf("\nReading sensor levels...\n");
+    gpio_snapshot = REG_READ(GPIO_IN_REG) | ((uint64_t)(REG_READ(GPIO_IN1_REG) & 0xFF) << 32);
+    beam_levels = sensorChannelsBeamLevels(sensor_channels, SENSOR_CHANNEL_COUNT, gpio_snapshot);
+    printf("Sensor read levels: 0x%02x.\n", beam_levels);    
     /* For debug. */
     printf("Deactivating IR pins...\n"); 
 
     turnOffIrPin(1ULL << IR_EMITTER_TRANSISTOR_PIN | 1ULL << IR_SENSOR_TRANSISTOR_PIN);
+    powerLedgerAdd(&power_ledger, POWER_IR_EMITTER, esp_timer_get_time() - emitter_on_us);
 
-    // printf("IR pin turned OFF. Signal should be LOW...\n");
-    // printf("Delaying... Check Signal if LOW...\n");
-    // vTaskDelay(IR_SENSOR_READ_DELAY);
-
-    return sensor_read_level;
+    return beam_levels;
 }
-/********** readIrPin() wrapper functions end. **********/
+/********** readIrPins() wrapper functions end. **********/
 /********** Pin configurations End. **********/
 
 
@@ -243,21 +333,13 @@ void configDeepSleep(sleep_mode_t mode) {
        Turning is OFF sets ref == 0 which makes it eligible for ESP_PD_OPTION_OFF since
        ref >= 0 is true.
     */
-    if(mode == SLEEP_INITIAL_TIME) {
-        esp_sleep_enable_timer_wakeup(TEST_INITIAL_SLEEP_TIME);
-    }
-    else if(mode == SLEEP_PIR_START_UP_TIME) {
-        esp_sleep_enable_timer_wakeup(TEST_PIR_START_UP_SLEEP_TIME);
-    }
-    else if(mode == SLEEP_AWAIT_MOTION) {
+    if(mode == SLEEP_AWAIT_MOTION) {
         rtc_pd_shutdown = false;
-        esp_sleep_enable_ext0_wakeup(PIR_READ_PIN, HIGH); /* This one is signal driven. The rest are timer-based wakeup source.*/
-    }
-    else if(mode == SLEEP_RETRIEVAL_TIME) {
-        esp_sleep_enable_timer_wakeup(TEST_FIRST_MOTION_DETECTED_SLEEP_TIME);
+        /* This one is signal driven. The rest are timer-based wakeup source. Any PIR of a channel with mail wakes the board. */
+        esp_sleep_enable_ext1_wakeup(sensorChannelsPirMask(sensor_channels, SENSOR_CHANNEL_COUNT, next_phase.slave.mail_channels), ESP_EXT1_WAKEUP_ANY_HIGH);
     }
-    else { /* mode == SLEEP_IR_BEAM_PULSE_TIME. */
-        esp_sleep_enable_timer_wakeup(TEST_IR_BEAM_PULSE_INTERVAL);
+    else {
+        esp_sleep_enable_timer_wakeup(slaveSleepUs(&slave_timing, mode));
     }
 
     // if(rtc_pd_shutdown) {
@@ -280,8 +362,13 @@ void configDeepSleep(sleep_mode_t mode) {
 
 /********** Send callback function definition start. **********/
 void onSent(const esp_now_send_info_t *peer_info, esp_now_send_status_t status) {
+    static uint32_t sends_completed = 0;
+    const send_status_t result = { .send_number = ++sends_completed, .status = status };
+
     printf("onSent() call entry...\n");
     printf("Send %s\n", status == ESP_NOW_SEND_SUCCESS ? "Succeeded" : "Failed");
+    /* Runs on the Wi-Fi task. try_send() waits for this. */
+    xQueueOverwrite(send_status_queue, &result);
     printf("onSent() call exit...\n");
 }/* End of onSent(). */
 
@@ -292,7 +379,7 @@ void onReceived(const esp_now_recv_info_t *peer_info, const uint8_t *data_receiv
 
     printf("\nReceived from:\n");
     printf("Sender MAC address: " MACSTR "\n", MAC2STR(peer_info->src_addr));
-    printf("Message Flag: %s\n", msg->flag == NORMAL_MESSAGE ? "NORMAL_MESSAGE" : msg->flag == SENSOR_READ ? "SENSOR_READ" : "ERROR_BROADCAST");
+    printf("Message Flag: %s\n", msg->flag == NORMAL_MESSAGE ? "NORMAL_MESSAGE" : msg->flag == SENSOR_READ ? "SENSOR_READ" : msg->flag == SENSOR_READ_BATCH ? "SENSOR_READ_BATCH" : "ERROR_BROADCAST");
     if(msg->flag == SENSOR_READ) {
         printf("Sensor read level: %s\n", msg->sensor_read_level == HIGH ? "HIGH" : "LOW");
     }
@@ -322,24 +409,52 @@ void broadcastPanic(uint8_t wifi_channel) {
         .message = "Error Broadcasted! Unicast failed. Check system configuration."
     };
 
-    esp_now_send(broadcast_mac, (uint8_t *)&msg, sizeof(msg));
+    if(esp_now_send(broadcast_mac, (uint8_t *)&msg, sizeof(msg)) == ESP_OK) {
+        ++sends_queued; /* Keeps the numbering in step with onSent(). */
+    }
 } /* End of broadcastPanic(). */
 
+/* Waits up to SLAVE_SEND_ACK_TIMEOUT_MS for the status of send_number. A status that arrives
+   late for an earlier try is skipped, so it can never pass or fail the current one. */
+bool waitForDelivery(uint32_t send_number) {
+    const TickType_t timeout = pdMS_TO_TICKS(SLAVE_SEND_ACK_TIMEOUT_MS);
+    const TickType_t start = xTaskGetTickCount();
+    send_status_t result;
+
+    while(xTaskGetTickCount() - start < timeout) {
+        if(xQueueReceive(send_status_queue, &result, timeout - (xTaskGetTickCount() - start)) != pdTRUE) {
+            break;
+        }
+        if(result.send_number == send_number) {
+            return result.status == ESP_NOW_SEND_SUCCESS;
+        }
+    }
+    return false;
+} /* End of waitForDelivery(). */
+
 /* Will resend message 3 times at most if it fails during the first try.
+   A try fails if esp_now_send() errors or onSent() does not report delivery in time.
 */
-esp_err_t try_send(const uint8_t *master_mac_addr, const esp_message msg) {
+esp_err_t try_send(const uint8_t *master_mac_addr, const void *data, size_t data_size) {
     esp_err_t err;
-    int try_cap = 4; /* 1 for the first send. 3 for the resend. */
-    size_t message_size = sizeof(msg.flag) + sizeof(msg.sensor_read_level) + strlen(msg.message) + 1; /* +1 for the NULL char. */
 
-    for(int i = 0; i < try_cap; ++i) {
+    for(int i = 0; i < SLAVE_SEND_TRY_CAP; ++i) {
     /* For debug. */
         printf("Retry #%d...\n", i);
-        err = esp_now_send(master_mac_addr, (const uint8_t *)&msg, message_size);
+        err = esp_now_send(master_mac_addr, (const uint8_t *)data, data_size);
+        powerLedgerAdd(&power_ledger, POWER_RADIO_TX, POWER_TX_AIRTIME_US);
+        ++power_ledger.tx_attempts;
 
-        if(err == ESP_OK) {
+        if(err != ESP_OK) {
+            continue;
+        }
+
+        /* Queued is not delivered. The MAC ACK result arrives through onSent(). */
+        if(waitForDelivery(++sends_queued)) {
             break;
         }
+        ++power_ledger.delivery_failures;
+        err = ESP_FAIL;
     }
 
     if(err != ESP_OK) {
@@ -352,162 +467,111 @@ esp_err_t try_send(const uint8_t *master_mac_addr, const esp_message msg) {
     return err;
 } /*End of try_send(). */
 
+/* Reports every channel in one frame. changed marks the channels that caused the report. */
+esp_err_t sendSensorBatch(const uint8_t *master_mac_addr, uint8_t beam_levels, uint8_t changed, const char *description) {
+    esp_batch_message msg = {
+        .flag = SENSOR_READ_BATCH,
+        .channel_count = SENSOR_CHANNEL_COUNT,
+        .beam_levels = beam_levels,
+        .changed = changed
+    };
+
+    snprintf(msg.message, sizeof(msg.message), "%s", description);
+    printf("%s\n", msg.message);
+
+    /* Only the used part of the description is sent. +1 for the NULL char. */
+    esp_err_t err = try_send(master_mac_addr, &msg, offsetof(esp_batch_message, message) + strlen(msg.message) + 1);
+    if(err == ESP_OK) {
+        power_ledger.events += __builtin_popcount(changed);
+    }
+    return err;
+} /* End of sendSensorBatch(). */
+
 
 /********** ESP_NOW_SEND wrapper functions end. **********/
 
 
+/********** slave_io_t callbacks start. **********/
+/* Pin and radio work for slaveStep(). ctx is unused since all of it lives in globals. */
+uint8_t ioReadBeams(void *ctx) {
+    return readIrPins();
+} /* End of ioReadBeams(). */
+
+/* The radio is started only when there is something to send. */
+bool ioSendBatch(void *ctx, uint8_t beam_levels, uint8_t changed, const char *description) {
+    if(radio_on_since_us == 0) {
+        printf("\nCalling setupESPNOW()...\n");
+        setupComponents(master_mac_addr, TEST_CHANNEL);
+    }
+    return sendSensorBatch(master_mac_addr, beam_levels, changed, description) == ESP_OK;
+} /* End of ioSendBatch(). */
+
+void ioPirPowerOn(void *ctx) {
+    printf("Activating rtc PIR transistor pins...\n");
+    rtc_PirTransistorPinConfig();
+    printf("PIR Sensor ON. Going to deep-sleep to allow it to calibrate...\n");
+} /* End of ioPirPowerOn(). */
+
+void ioPirArm(void *ctx, uint8_t channels) {
+    printf("PIR Sensor Ready. Activating rtc PIR read pins...\n");
+    rtc_PirReadPinConfig(sensorChannelsPirMask(sensor_channels, SENSOR_CHANNEL_COUNT, channels));
+    printf("Entering deep-sleep to await motion trigger...\n");
+} /* End of ioPirArm(). */
+
+/* Reports which PIRs fired. The IR pulse reads every beam in one snapshot, so it does not narrow the check. */
+void ioMotionWake(void *ctx) {
+    uint8_t motion_channels = sensorChannelsFromPins(sensor_channels, SENSOR_CHANNEL_COUNT, esp_sleep_get_ext1_wakeup_status());
+    printf("First motion detected on channels 0x%02x. Entering deep-sleep to allow user to empty mailbox...\n", motion_channels);
+} /* End of ioMotionWake(). */
+
+void ioPirOff(void *ctx) {
+    rtc_PirTurnOff();
+} /* End of ioPirOff(). */
+/********** slave_io_t callbacks end. **********/
+
+
 /********** APP_MAIN start. **********/
 
 /*
-    Program will first read the pin. If the pin reads HIGH, it will not do anything and will go back to sleep.
-    Otherwise, the program will set up appropriate components of ESP32 to send the data back to master device.
-    This way, the program can avoid unnecessary component setup when pin is HIGH, since it will not send anything.
+    Every wake runs one step of the state machine in slave_logic.c and goes back to deep sleep.
+    The radio is only set up when a step has something to send, so a wake with every beam
+    unbroken costs one IR read. All channels share one wake and one frame, so N mailboxes
+    cost the same as one.
 */
 
 void app_main(void) {
     printf("app_main() start...\n");
-    device_state_t current_state;
-    sleep_mode_t next_sleep_mode = SLEEP_INITIAL_TIME;
+    const slave_io_t io = {
+        .readBeams = ioReadBeams,
+        .sendBatch = ioSendBatch,
+        .pirPowerOn = ioPirPowerOn,
+        .pirArm = ioPirArm,
+        .motionWake = ioMotionWake,
+        .pirOff = ioPirOff
+    };
+    sleep_mode_t next_sleep_mode;
+
+    powerAccountWake();
+
+    if(!sensorChannelsValid(sensor_channels, SENSOR_CHANNEL_COUNT, TRANSISTOR_PINS)) {
+        printf("Invalid sensor channel table! Check pin assignments.\n");
+        abort();
+    }
 
     printf("Checking magic number to verify next state...\n");
     if(next_phase.magicNumber != MAGIC_NUMBER) {
         printf("Invalid Magic Number!\n");
-        next_phase.state = INITIAL_READ;
+        slaveStateReset(&next_phase.slave);
         next_phase.magicNumber = MAGIC_NUMBER;
     }
-    
-    current_state = next_phase.state;
 
-    printf("Entering switch(current_state) statement...\n");
- 
     /* next_phase is stored in RTC SLOW MEMORY. */
-    switch(current_state) {
-        case INITIAL_READ: {
-            printf("Case INITIAL_READ");
-            uint8_t sensor_read_level = readIrPin();
-
-            printf("\nSensor read level: %s\n", sensor_read_level == HIGH ? "HIGH" : "LOW");
-
-            /* If mail in mailbox, setup necessary components for data tranmission to update Master. */
-            if(sensor_read_level == LOW) {
-                /* Hard-coded for test. But in release, this must still be 
-                known ahead of time if broadcast is not used to acquire it. 
-                */
-                const uint8_t master_mac_addr[ESP_NOW_ETH_ALEN] = {0x88, 0x13, 0xbf, 0x0b, 0xe1, 0x50};
-            
-                printf("\nCalling setupESPNOW()...\n");
-                /* Set up components to be used for ESP-NOW data transmission. */
-                setupComponents(master_mac_addr, TEST_CHANNEL); 
-
-                /* Message structure. */
-                esp_message msg;
-
-                /* ----- Initial message to master. This can be removed in necessary. ----- */
-                msg.flag = NORMAL_MESSAGE;
-                msg.sensor_read_level = 0; /* Hard-coded since initial message will not contain actual sensor read level. */
-                sprintf(msg.message, "Greetings from Slave device!");
-                printf("Sending initial message to greet Master...\n");
-
-                /* Try to send inital message to check if there's any problem. */
-                if(try_send(master_mac_addr, msg) == ESP_OK) {
-                    /* ----- Sensor Read Message ----- */
-
-                    /* Description for LOW level sensor read. */
-                    char sensor_read_level_description[50];
-                    sprintf(sensor_read_level_description, "Beam broken. There is mail in the mailbox.");
-
-                    /* This may not be necessary if not printing to serial for debug. */
-                    printf(sensor_read_level_description);
-                    printf("\n");
-
-                    msg.flag = SENSOR_READ;
-                    msg.sensor_read_level = sensor_read_level;
-                    snprintf(msg.message, sizeof(msg.message), sensor_read_level_description);
-                    printf("\nSending subsequent message...\n");
-            
-                    if(try_send(master_mac_addr, msg) == ESP_OK) {
-                        /* Activate PIR sensor. */
-                        /* For debug. */
-                        printf("Activating rtc PIR transistor pins...\n");
-                        rtc_PirTransistorPinConfig();
-                        next_sleep_mode = SLEEP_PIR_START_UP_TIME;
-                        next_phase.state = PIR_READY;
-                        printf("PIR Sensor ON. Going to deep-sleep to allow it to calibrate...\n");
-                    } /* if for sensor read message. */
-                } /* if for inital message. */
-            }
-            break;
-        }  /* case FROM_INITIAL_READ: */
-
-        case PIR_READY: { /* After PIR startup. */
-            printf("PIR Sensor Ready...\n");
-            printf("Activating rtc PIR read pins...\n");
-            rtc_PirReadPinConfig();
-            next_sleep_mode = SLEEP_AWAIT_MOTION;
-            printf("Entering deep-sleep to await motion trigger...\n");
-            next_phase.state = RETRIEVAL_PHASE;
-            break;
-        } /* case PIR_START_UP: */
-        case RETRIEVAL_PHASE: {
-            printf("First motion detected. Entering deep-sleep to allow user to empty mailbox...\n");
-            rtc_PirTurnOff();
-            next_sleep_mode = SLEEP_RETRIEVAL_TIME;
-            next_phase.state = IR_BEAM_PULSE;
-            break;
-        } /* case AWAITING_FOR_MOTION: */
-        case IR_BEAM_PULSE: {            
-
-            printf("IR Beam Pulse Phase...\n");
-            next_sleep_mode = SLEEP_INITIAL_TIME; /* Assuming it's Done. Reset state.*/
-
-            if(pulse_counter < MAX_PULSE_COUNT) {
-                uint8_t sensor_read_level = readIrPin();
-                if(sensor_read_level == HIGH) {
-                    /* Hard-coded for test. But in release, this must still be 
-                    known ahead of time if broadcast is not used to acquire it. 
-                    */
-                    const uint8_t master_mac_addr[ESP_NOW_ETH_ALEN] = {0x88, 0x13, 0xbf, 0x0b, 0xe1, 0x50};
-                
-                    printf("\nCalling setupESPNOW()...\n");
-                    /* Set up components to be used for ESP-NOW data transmission. */
-                    setupComponents(master_mac_addr, TEST_CHANNEL); 
-
-                    /* Message structure. */
-                    esp_message msg;
-
-                    /* Description for HIGH level sensor read. */
-                    char sensor_read_level_description[50];
-                    sprintf(sensor_read_level_description, "Beam unbroken. Mailbox now empty.");
-
-                    /* This may not be necessary if not printing to serial for debug. */
-                    printf(sensor_read_level_description);
-                    printf("\n");
-
-                    msg.flag = SENSOR_READ;
-                    msg.sensor_read_level = sensor_read_level;
-                    snprintf(msg.message, sizeof(msg.message), sensor_read_level_description);
-                    printf("\nSending subsequent message...\n");
-                    
-                    try_send(master_mac_addr, msg);
-                    next_phase.state = INITIAL_READ;
-                    
-                } /* for if(sensor_read_level == HIGH). */
-                else { /* sensor_read_level == LOW */
-                    next_sleep_mode = SLEEP_IR_BEAM_PULSE_TIME;
-                    ++pulse_counter;
-                    printf("IR Pulse Count: %d.\n", pulse_counter);
-                    if(pulse_counter == MAX_PULSE_COUNT) {
-                        printf("Max Pulse Count Reached! Returning to initial state.\n");
-                        next_phase.state = INITIAL_READ;
-                        pulse_counter = 0;
-                    }
-                }
-            } /* for if(pulse_counter < MAX_PULSE_COUNT).*/
-            break;
-        } /* case IR_BEAM_PULSE: */
-    } /* switch(phase). */
+    printf("State %d, pulse count %d, channels with mail 0x%02x.\n",
+           next_phase.slave.state, next_phase.slave.pulse_counter, next_phase.slave.mail_channels);
+    next_sleep_mode = slaveStep(&next_phase.slave, SENSOR_CHANNEL_COUNT, &io);
 
     configDeepSleep(next_sleep_mode);
+    powerAccountSleep();
     ESP_ERROR_CHECK(esp_deep_sleep_try_to_start()); // Do not send until
 } // End of app_main().
 
@@ -0,0 +1,50 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Battery usage from counted power state times. See power_model.h.
+*/
+
+#include "power_model.h"
+
+#define US_PER_HOUR 3600000000.0
+
+
+/* Negative durations come from clock jumps and are ignored. */
+void powerLedgerAdd(power_ledger_t *ledger, power_state_t state, int64_t duration_us) {
+    if(state < POWER_STATE_COUNT && duration_us > 0) {
+        ledger->time_us[state] += (uint64_t)duration_us;
+    }
+} /* End of powerLedgerAdd(). */
+
+/* Sum of the base states only. Loads overlap them. */
+double powerElapsedHours(const power_ledger_t *ledger) {
+    uint64_t elapsed_us = ledger->time_us[POWER_CPU_AWAKE] + ledger->time_us[POWER_LIGHT_SLEEP] + ledger->time_us[POWER_DEEP_SLEEP];
+    return elapsed_us / US_PER_HOUR;
+} /* End of powerElapsedHours(). */
+
+double powerChargeMah(const power_ledger_t *ledger, const power_profile_t *profile) {
+    double charge = 0;
+
+    for(int i = 0; i < POWER_STATE_COUNT; ++i) {
+        charge += profile->current_ma[i] * (ledger->time_us[i] / US_PER_HOUR);
+    }
+    return charge;
+} /* End of powerChargeMah(). */
+
+/* Battery life if the device keeps drawing at the average rate seen so far. 0 if nothing was counted yet. */
+double powerProjectedDays(const power_ledger_t *ledger, const power_profile_t *profile) {
+    double hours = powerElapsedHours(ledger);
+    double charge = powerChargeMah(ledger, profile);
+
+    if(hours <= 0 || charge <= 0) {
+        return 0;
+    }
+    return profile->battery_mah / (charge / hours) / 24.0;
+} /* End of powerProjectedDays(). */
+
+/* All charge used, including quiet periods, divided by mailbox events. 0 if there were no events. */
+double powerChargePerEventMah(const power_ledger_t *ledger, const power_profile_t *profile) {
+    if(ledger->events == 0) {
+        return 0;
+    }
+    return powerChargeMah(ledger, profile) / ledger->events;
+} /* End of powerChargePerEventMah(). */
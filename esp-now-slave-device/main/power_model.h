@@ -0,0 +1,74 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Counts time spent in each power state and turns it into battery usage.
+
+Base states (CPU awake, light sleep, deep sleep) never overlap and together
+make up the elapsed time. Loads (radio, IR emitter, PIR) are counted on top
+of whatever base state the chip is in, and their current in the profile is
+the extra draw they add.
+
+The radio loads nest. RX time covers the whole window Wi-Fi is on, TX time
+falls inside it, and the CPU is awake for both. So RX is the extra over CPU
+awake and TX is the extra over RX, never the absolute figure from a datasheet.
+
+No ESP-IDF dependency, so a host build can feed the same ledger from a trace.
+*/
+
+#ifndef POWER_MODEL_H
+#define POWER_MODEL_H
+
+#include <stdint.h>
+
+typedef enum power_state {
+    /* Base states. */
+    POWER_CPU_AWAKE,
+    POWER_LIGHT_SLEEP,
+    POWER_DEEP_SLEEP,
+    /* Loads. */
+    POWER_RADIO_TX, /* Extra over POWER_RADIO_RX while transmitting. */
+    POWER_RADIO_RX, /* Extra over POWER_CPU_AWAKE while Wi-Fi is started and listening. */
+    POWER_IR_EMITTER, /* Emitters and IR sensors powered. */
+    POWER_PIR, /* PIR transistor on. */
+    POWER_STATE_COUNT
+} power_state_t;
+
+typedef struct power_profile {
+    float current_ma[POWER_STATE_COUNT];
+    float battery_mah;
+} power_profile_t;
+
+/* Kept in RTC memory so it survives deep sleep. */
+typedef struct power_ledger {
+    uint64_t time_us[POWER_STATE_COUNT];
+    uint32_t wakes;
+    uint32_t tx_attempts;
+    uint32_t delivery_failures; /* Attempts queued by the radio but not acknowledged by the master. */
+    uint32_t events; /* Mailbox events reported to the master. One per channel. */
+} power_ledger_t;
+
+/* Rough ESP32 module figures. Measure the real board and override these.
+   Absolute draw: awake 40 mA, listening 100 mA, transmitting 230 mA. */
+#define POWER_PROFILE_DEFAULT { \
+    .current_ma = { \
+        [POWER_CPU_AWAKE] = 40.0f, \
+        [POWER_LIGHT_SLEEP] = 0.8f, \
+        [POWER_DEEP_SLEEP] = 0.01f, \
+        [POWER_RADIO_TX] = 130.0f, /* 230 - 100. */ \
+        [POWER_RADIO_RX] = 60.0f, /* 100 - 40. */ \
+        [POWER_IR_EMITTER] = 20.0f, \
+        [POWER_PIR] = 0.065f \
+    }, \
+    .battery_mah = 2000.0f \
+}
+
+/* Time the chip spends in states no timer can see. Shared by the firmware and host benchmarks. */
+#define POWER_BOOT_OVERHEAD_US 150000 /* Bootloader time before esp_timer starts counting. Estimate. */
+#define POWER_TX_AIRTIME_US 1000 /* Per esp_now_send() attempt, including the MAC ACK wait. Estimate. */
+
+void powerLedgerAdd(power_ledger_t *ledger, power_state_t state, int64_t duration_us);
+double powerElapsedHours(const power_ledger_t *ledger);
+double powerChargeMah(const power_ledger_t *ledger, const power_profile_t *profile);
+double powerProjectedDays(const power_ledger_t *ledger, const power_profile_t *profile);
+double powerChargePerEventMah(const power_ledger_t *ledger, const power_profile_t *profile);
+
+#endif /* POWER_MODEL_H */
@@ -0,0 +1,102 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Pin mask helpers for the sensor channel table. See sensor_channels.h.
+*/
+
+#include "sensor_channels.h"
+#include "../../misc-headers/esp-now-message-struct.h"
+
+/* GPIO0-39 minus the numbers the ESP32 does not have (20, 24, 28-31) and 6-11, which are wired to the SPI flash. */
+#define USABLE_GPIO_MASK (((1ULL << SENSOR_GPIO_PIN_COUNT) - 1) & \
+                          ~(SENSOR_PIN_BIT(6) | SENSOR_PIN_BIT(7) | SENSOR_PIN_BIT(8) | SENSOR_PIN_BIT(9) | \
+                            SENSOR_PIN_BIT(10) | SENSOR_PIN_BIT(11) | \
+                            SENSOR_PIN_BIT(20) | SENSOR_PIN_BIT(24) | SENSOR_PIN_BIT(28) | SENSOR_PIN_BIT(29) | \
+                            SENSOR_PIN_BIT(30) | SENSOR_PIN_BIT(31)))
+
+/* ESP32 pins that stay readable in deep sleep and can drive ext1 wakeup. */
+#define RTC_GPIO_MASK (SENSOR_PIN_BIT(0) | SENSOR_PIN_BIT(2) | SENSOR_PIN_BIT(4) | \
+                       SENSOR_PIN_BIT(12) | SENSOR_PIN_BIT(13) | SENSOR_PIN_BIT(14) | SENSOR_PIN_BIT(15) | \
+                       SENSOR_PIN_BIT(25) | SENSOR_PIN_BIT(26) | SENSOR_PIN_BIT(27) | \
+                       SENSOR_PIN_BIT(32) | SENSOR_PIN_BIT(33) | SENSOR_PIN_BIT(34) | SENSOR_PIN_BIT(35) | \
+                       SENSOR_PIN_BIT(36) | SENSOR_PIN_BIT(37) | SENSOR_PIN_BIT(38) | SENSOR_PIN_BIT(39))
+
+
+/* Checks the table fits in one frame, every pin exists and is free, IR pins have a pull-up,
+   PIR pins can wake the chip and no pin is used twice. reserved_pins holds pins the board drives for something else. */
+bool sensorChannelsValid(const sensor_channel_t *channels, size_t count, uint64_t reserved_pins) {
+    uint64_t used = reserved_pins;
+
+    if(count == 0 || count > MAX_SENSOR_CHANNELS) {
+        return false;
+    }
+
+    for(size_t i = 0; i < count; ++i) {
+        uint8_t ir = channels[i].ir_read_pin;
+        uint8_t pir = channels[i].pir_read_pin;
+
+        if(ir >= SENSOR_GPIO_PIN_COUNT || pir >= SENSOR_GPIO_PIN_COUNT || ir == pir) {
+            return false;
+        }
+        if(!(USABLE_GPIO_MASK & SENSOR_PIN_BIT(ir)) || !(USABLE_GPIO_MASK & SENSOR_PIN_BIT(pir))) {
+            return false; /* gpio_config() would fail and the snapshot bit would always read 0. */
+        }
+        if(ir >= SENSOR_FIRST_INPUT_ONLY_PIN) {
+            return false; /* IR read pins rely on the internal pull-up. */
+        }
+        if(!(RTC_GPIO_MASK & SENSOR_PIN_BIT(pir))) {
+            return false;
+        }
+        if(used & (SENSOR_PIN_BIT(ir) | SENSOR_PIN_BIT(pir))) {
+            return false;
+        }
+        used |= SENSOR_PIN_BIT(ir) | SENSOR_PIN_BIT(pir);
+    }
+
+    return true;
+} /* End of sensorChannelsValid(). */
+
+/* Every IR read pin, for configuring them in one gpio_config() call. */
+uint64_t sensorChannelsIrMask(const sensor_channel_t *channels, size_t count) {
+    uint64_t mask = 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        mask |= SENSOR_PIN_BIT(channels[i].ir_read_pin);
+    }
+    return mask;
+} /* End of sensorChannelsIrMask(). */
+
+/* PIR read pins of the channels set in channel_mask. Used as the ext1 wakeup mask. */
+uint64_t sensorChannelsPirMask(const sensor_channel_t *channels, size_t count, uint8_t channel_mask) {
+    uint64_t mask = 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        if(channel_mask & (1U << i)) {
+            mask |= SENSOR_PIN_BIT(channels[i].pir_read_pin);
+        }
+    }
+    return mask;
+} /* End of sensorChannelsPirMask(). */
+
+/* Turns a snapshot of the GPIO input registers (bit n == GPIO n) into one level bit per channel. */
+uint8_t sensorChannelsBeamLevels(const sensor_channel_t *channels, size_t count, uint64_t gpio_snapshot) {
+    uint8_t levels = 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        if(gpio_snapshot & SENSOR_PIN_BIT(channels[i].ir_read_pin)) {
+            levels |= 1U << i;
+        }
+    }
+    return levels;
+} /* End of sensorChannelsBeamLevels(). */
+
+/* Maps pins reported by esp_sleep_get_ext1_wakeup_status() back to channels. */
+uint8_t sensorChannelsFromPins(const sensor_channel_t *channels, size_t count, uint64_t pir_pin_mask) {
+    uint8_t channel_mask = 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        if(pir_pin_mask & SENSOR_PIN_BIT(channels[i].pir_read_pin)) {
+            channel_mask |= 1U << i;
+        }
+    }
+    return channel_mask;
+} /* End of sensorChannelsFromPins(). */
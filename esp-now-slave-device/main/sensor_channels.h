@@ -0,0 +1,35 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Sensor channel table for slaves that watch several mailboxes.
+
+Each channel is one mailbox: an IR beam read pin and a PIR read pin. All
+emitters, IR sensors and PIRs share the power transistors, so one wake powers
+every channel and one GPIO input register snapshot reads every beam.
+
+Everything here works on plain bitmasks and has no ESP-IDF dependency, so it
+can be compiled and checked on a host machine.
+*/
+
+#ifndef SENSOR_CHANNELS_H
+#define SENSOR_CHANNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SENSOR_GPIO_PIN_COUNT 40
+#define SENSOR_PIN_BIT(pin) (1ULL << (pin))
+#define SENSOR_FIRST_INPUT_ONLY_PIN 34 /* GPIO34-39 are input only and have no pull-up/down. */
+
+typedef struct sensor_channel {
+    uint8_t ir_read_pin; /* Needs an internal pull-up, so not GPIO34-39. LOW == beam broken. */
+    uint8_t pir_read_pin; /* Must be RTC capable so it can be used for ext1 wakeup. */
+} sensor_channel_t;
+
+bool sensorChannelsValid(const sensor_channel_t *channels, size_t count, uint64_t reserved_pins);
+uint64_t sensorChannelsIrMask(const sensor_channel_t *channels, size_t count);
+uint64_t sensorChannelsPirMask(const sensor_channel_t *channels, size_t count, uint8_t channel_mask);
+uint8_t sensorChannelsBeamLevels(const sensor_channel_t *channels, size_t count, uint64_t gpio_snapshot);
+uint8_t sensorChannelsFromPins(const sensor_channel_t *channels, size_t count, uint64_t pir_pin_mask);
+
+#endif /* SENSOR_CHANNELS_H */
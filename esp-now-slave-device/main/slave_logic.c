@@ -0,0 +1,95 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Mailbox state machine. See slave_logic.h.
+*/
+
+#include "slave_logic.h"
+
+
+void slaveStateReset(slave_state_t *state) {
+    state->state = INITIAL_READ;
+    state->pulse_counter = 0;
+    state->mail_channels = 0;
+} /* End of slaveStateReset(). */
+
+/*
+    First reads every channel. If all beams are unbroken it goes back to sleep without
+    starting the radio. Otherwise it reports every channel in one frame, powers the PIRs
+    and waits for motion, then pulses the beams until the mailboxes are emptied.
+*/
+sleep_mode_t slaveStep(slave_state_t *state, uint8_t channel_count, const slave_io_t *io) {
+    uint8_t all_channels = (uint8_t)((1U << channel_count) - 1);
+    sleep_mode_t next_sleep_mode = SLEEP_INITIAL_TIME;
+
+    switch(state->state) {
+        case INITIAL_READ: {
+            uint8_t beam_levels = io->readBeams(io->ctx);
+            uint8_t full_channels = ~beam_levels & all_channels;
+
+            /* Stay in INITIAL_READ until the master has the report, so a failed send is retried next wake. */
+            if(full_channels != 0 &&
+               io->sendBatch(io->ctx, beam_levels, full_channels, "Beam broken. There is mail in the mailbox.")) {
+                io->pirPowerOn(io->ctx);
+                state->mail_channels = full_channels;
+                state->state = PIR_READY;
+                next_sleep_mode = SLEEP_PIR_START_UP_TIME;
+            }
+            break;
+        } /* case INITIAL_READ: */
+
+        case PIR_READY: { /* After PIR startup. */
+            io->pirArm(io->ctx, state->mail_channels);
+            state->state = RETRIEVAL_PHASE;
+            next_sleep_mode = SLEEP_AWAIT_MOTION;
+            break;
+        } /* case PIR_READY: */
+
+        case RETRIEVAL_PHASE: {
+            io->motionWake(io->ctx);
+            io->pirOff(io->ctx);
+            state->state = IR_BEAM_PULSE;
+            next_sleep_mode = SLEEP_RETRIEVAL_TIME;
+            break;
+        } /* case RETRIEVAL_PHASE: */
+
+        case IR_BEAM_PULSE: {
+            if(state->pulse_counter < SLAVE_MAX_PULSE_COUNT) {
+                uint8_t beam_levels = io->readBeams(io->ctx);
+                uint8_t emptied_channels = state->mail_channels & beam_levels;
+
+                if(emptied_channels != 0) {
+                    io->sendBatch(io->ctx, beam_levels, emptied_channels, "Beam unbroken. Mailbox now empty.");
+                    state->mail_channels &= ~emptied_channels;
+                }
+
+                if(state->mail_channels == 0) { /* Every mailbox emptied. */
+                    state->state = INITIAL_READ;
+                    state->pulse_counter = 0;
+                }
+                else { /* Some beams still broken. */
+                    next_sleep_mode = SLEEP_IR_BEAM_PULSE_TIME;
+                    ++state->pulse_counter;
+                    if(state->pulse_counter == SLAVE_MAX_PULSE_COUNT) { /* Give up and start over. */
+                        state->state = INITIAL_READ;
+                        state->pulse_counter = 0;
+                    }
+                }
+            }
+            break;
+        } /* case IR_BEAM_PULSE: */
+    }
+
+    return next_sleep_mode;
+} /* End of slaveStep(). */
+
+/* 0 for SLEEP_AWAIT_MOTION, which only wakes on a PIR signal. */
+uint64_t slaveSleepUs(const slave_timing_t *timing, sleep_mode_t mode) {
+    switch(mode) {
+        case SLEEP_INITIAL_TIME: return timing->initial_us;
+        case SLEEP_PIR_START_UP_TIME: return timing->pir_start_up_us;
+        case SLEEP_AWAIT_MOTION: return 0;
+        case SLEEP_RETRIEVAL_TIME: return timing->retrieval_us;
+        case SLEEP_IR_BEAM_PULSE_TIME: return timing->beam_pulse_us;
+    }
+    return timing->initial_us;
+} /* End of slaveSleepUs(). */
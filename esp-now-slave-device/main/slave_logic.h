@@ -0,0 +1,80 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Mailbox state machine run once per wake by the slave.
+
+Every wake reads the state saved in RTC memory, does the work for that state
+through the callbacks in slave_io_t and returns the sleep to enter next. The
+callbacks do the pin, radio and sleep work, so this file has no ESP-IDF
+dependency and the same state machine can be replayed on a host machine.
+*/
+
+#ifndef SLAVE_LOGIC_H
+#define SLAVE_LOGIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SLAVE_MAX_PULSE_COUNT 3
+#define SLAVE_SEND_TRY_CAP 4 /* 1 for the first send. 3 for the resend. */
+#define SLAVE_SEND_ACK_TIMEOUT_MS 100 /* Wait for the send status before counting a try as lost. */
+
+typedef enum device_state {
+    INITIAL_READ, /* Wakeup source: Timer. */
+    PIR_READY, /* Sleep until first motion detected. Wakeup source: PIR read pins. */
+    RETRIEVAL_PHASE, /* Sleep to give user time to empty mailbox. Wakeup source: Timer. */
+    IR_BEAM_PULSE /* For beam pulse intervals. Wakeup source: Timer.*/
+} device_state_t;
+
+typedef enum sleep_mode {
+    SLEEP_INITIAL_TIME,
+    SLEEP_PIR_START_UP_TIME,
+    SLEEP_AWAIT_MOTION,
+    SLEEP_RETRIEVAL_TIME,
+    SLEEP_IR_BEAM_PULSE_TIME
+} sleep_mode_t;
+
+/* Kept in RTC memory so it survives deep sleep. */
+typedef struct slave_state {
+    device_state_t state;
+    uint8_t pulse_counter;
+    uint8_t mail_channels; /* Bit n set: channel n was reported as having mail. */
+} slave_state_t;
+
+/* Timer wakeup for each sleep mode, in microseconds. */
+typedef struct slave_timing {
+    uint64_t initial_us;
+    uint64_t pir_start_up_us;
+    uint64_t retrieval_us;
+    uint64_t beam_pulse_us;
+} slave_timing_t;
+
+#define SLAVE_TIMING_TEST { \
+    .initial_us = 5000000ULL, /* 5 seconds. */ \
+    .pir_start_up_us = 60000000ULL, /* 60 seconds. */ \
+    .retrieval_us = 5000000ULL, /* 5 seconds. */ \
+    .beam_pulse_us = 5000000ULL /* 5 seconds. */ \
+}
+
+#define SLAVE_TIMING_RELEASE { \
+    .initial_us = 43200000000ULL, /* 12 hours. */ \
+    .pir_start_up_us = 60000000ULL, /* 1 minute. */ \
+    .retrieval_us = 60000000ULL, /* 1 minute. */ \
+    .beam_pulse_us = 30000000ULL /* 30 seconds. */ \
+}
+
+/* Hardware and radio work done for the state machine. ctx is passed back to every call. */
+typedef struct slave_io {
+    void *ctx;
+    uint8_t (*readBeams)(void *ctx); /* One level bit per channel. Bit clear: beam broken (mail). */
+    bool (*sendBatch)(void *ctx, uint8_t beam_levels, uint8_t changed, const char *description); /* true once delivered. */
+    void (*pirPowerOn)(void *ctx);
+    void (*pirArm)(void *ctx, uint8_t channels); /* Read pins of these channels become the wakeup source. */
+    void (*motionWake)(void *ctx); /* Woken by a PIR. Every channel with mail is pulsed after, whichever PIR fired. */
+    void (*pirOff)(void *ctx);
+} slave_io_t;
+
+void slaveStateReset(slave_state_t *state);
+sleep_mode_t slaveStep(slave_state_t *state, uint8_t channel_count, const slave_io_t *io);
+uint64_t slaveSleepUs(const slave_timing_t *timing, sleep_mode_t mode);
+
+#endif /* SLAVE_LOGIC_H */
@@ -0,0 +1,264 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Battery life benchmarks for the slave. Replays mailbox traces through
+the same state machine the firmware runs (slave_logic.c) with release timing,
+feeds the power ledger with modelled durations, and fails when projected
+battery life or charge per mailbox event crosses the limits below.
+Run with: pio test -e native -f test_power_bench -v
+*/
+
+#include <stdio.h>
+#include <unity.h>
+#include "power_model.h"
+#include "slave_logic.h"
+
+#define US_PER_HOUR 3600000000ULL
+#define US_PER_DAY (24 * US_PER_HOUR)
+
+/* Modelled durations of the work done outside esp_timer's view or inside the callbacks. */
+#define SIM_WAKE_WORK_US 20000 /* app_main() outside the callbacks. */
+#define SIM_IR_READ_US 50000 /* IR_SENSOR_READ_DELAY: 5 ticks at 100 Hz. */
+#define SIM_RADIO_SETUP_US 250000 /* NVS, Wi-Fi and ESP-NOW init. */
+#define SIM_ACK_TIMEOUT_US (SLAVE_SEND_ACK_TIMEOUT_MS * 1000ULL)
+
+/* Limits. Projected days on the default profile, and mAh per mailbox event.
+   Measured: 8149, 1920 / 0.530, 1910 / 0.564, 7104. The PIR waiting for motion dominates the mail days. */
+#define MIN_DAYS_QUIET_WEEK 7500.0
+#define MIN_DAYS_DAILY_DELIVERY 1750.0
+#define MAX_MAH_PER_EVENT_DAILY_DELIVERY 0.58
+#define MIN_DAYS_FLAKY_LINK 1700.0
+#define MAX_MAH_PER_EVENT_FLAKY_LINK 0.62
+#define MIN_DAYS_MASTER_OFFLINE 6500.0
+
+typedef struct trace {
+    const char *name;
+    uint32_t days;
+    bool mail; /* false: mailbox stays empty. */
+    uint64_t delivery_us; /* Time of day mail arrives. */
+    uint64_t hold_us; /* How long it stays before being collected. Collection is the PIR motion. */
+    uint32_t ack_percent; /* Chance the master acknowledges one send attempt. */
+} trace_t;
+
+typedef struct sim {
+    const trace_t *trace;
+    power_ledger_t ledger;
+    uint64_t now_us;
+    uint64_t end_us;
+    bool radio_on;
+    bool pir_on;
+    uint64_t pir_on_since_us;
+    uint32_t rng;
+} sim_t;
+
+/* Mail delivered every day at 11:00 and collected the next morning at 08:00. */
+static const trace_t quiet_week = { "quiet week", 7, false, 0, 0, 100 };
+static const trace_t daily_delivery = { "daily delivery", 28, true, 11 * US_PER_HOUR, 21 * US_PER_HOUR, 100 };
+static const trace_t flaky_link = { "flaky link", 28, true, 11 * US_PER_HOUR, 21 * US_PER_HOUR, 50 };
+static const trace_t master_offline = { "master offline", 28, true, 11 * US_PER_HOUR, 21 * US_PER_HOUR, 0 };
+
+static const slave_timing_t timing = SLAVE_TIMING_RELEASE;
+static const power_profile_t profile = POWER_PROFILE_DEFAULT;
+
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+/* Time spent awake. Moves the clock and counts CPU time. */
+static void spend(sim_t *sim, uint64_t duration_us) {
+    sim->now_us += duration_us;
+    powerLedgerAdd(&sim->ledger, POWER_CPU_AWAKE, duration_us);
+    if(sim->radio_on) {
+        powerLedgerAdd(&sim->ledger, POWER_RADIO_RX, duration_us);
+    }
+}
+
+static bool hasMail(const sim_t *sim) {
+    const trace_t *trace = sim->trace;
+
+    if(!trace->mail || sim->now_us < trace->delivery_us) {
+        return false;
+    }
+    return (sim->now_us - trace->delivery_us) % US_PER_DAY < trace->hold_us;
+}
+
+/* Next collection after now, or the end of the trace. */
+static uint64_t nextMotionUs(const sim_t *sim) {
+    const trace_t *trace = sim->trace;
+    uint64_t collection_us = trace->delivery_us + trace->hold_us;
+
+    if(!trace->mail) {
+        return sim->end_us;
+    }
+    while(collection_us <= sim->now_us) {
+        collection_us += US_PER_DAY;
+    }
+    return collection_us < sim->end_us ? collection_us : sim->end_us;
+}
+
+/* xorshift32. Fixed seed so every run replays the same losses. */
+static bool acked(sim_t *sim) {
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 17;
+    sim->rng ^= sim->rng << 5;
+    return sim->rng % 100 < sim->trace->ack_percent;
+}
+
+
+/********** slave_io_t callbacks, same accounting as main.c. **********/
+static uint8_t simReadBeams(void *ctx) {
+    sim_t *sim = ctx;
+
+    spend(sim, SIM_IR_READ_US);
+    powerLedgerAdd(&sim->ledger, POWER_IR_EMITTER, SIM_IR_READ_US);
+    return hasMail(sim) ? 0x00 : 0x01;
+}
+
+/* Mirrors try_send(): up to SLAVE_SEND_TRY_CAP tries, each waiting for the ACK, then a broadcast. */
+static bool simSendBatch(void *ctx, uint8_t beam_levels, uint8_t changed, const char *description) {
+    sim_t *sim = ctx;
+
+    if(!sim->radio_on) {
+        sim->radio_on = true;
+        spend(sim, SIM_RADIO_SETUP_US);
+    }
+
+    for(int i = 0; i < SLAVE_SEND_TRY_CAP; ++i) {
+        spend(sim, POWER_TX_AIRTIME_US);
+        powerLedgerAdd(&sim->ledger, POWER_RADIO_TX, POWER_TX_AIRTIME_US);
+        ++sim->ledger.tx_attempts;
+
+        if(acked(sim)) {
+            sim->ledger.events += __builtin_popcount(changed);
+            return true;
+        }
+        spend(sim, SIM_ACK_TIMEOUT_US);
+        ++sim->ledger.delivery_failures;
+    }
+
+    /* broadcastPanic(). */
+    spend(sim, POWER_TX_AIRTIME_US);
+    powerLedgerAdd(&sim->ledger, POWER_RADIO_TX, POWER_TX_AIRTIME_US);
+    return false;
+}
+
+static void simPirPowerOn(void *ctx) {
+    sim_t *sim = ctx;
+
+    sim->pir_on = true;
+    sim->pir_on_since_us = sim->now_us;
+}
+
+static void simPirArm(void *ctx, uint8_t channels) {
+}
+
+static void simMotionWake(void *ctx) {
+}
+
+static void simPirOff(void *ctx) {
+    sim_t *sim = ctx;
+
+    if(sim->pir_on) {
+        powerLedgerAdd(&sim->ledger, POWER_PIR, sim->now_us - sim->pir_on_since_us);
+        sim->pir_on = false;
+    }
+}
+/********** slave_io_t callbacks end. **********/
+
+
+/* Runs one wake per loop until the trace ends. The device powers on at midnight. */
+static power_ledger_t runTrace(const trace_t *trace) {
+    sim_t sim = { .trace = trace, .end_us = trace->days * US_PER_DAY, .rng = 0x2545F491 };
+    const slave_io_t io = {
+        .ctx = &sim,
+        .readBeams = simReadBeams,
+        .sendBatch = simSendBatch,
+        .pirPowerOn = simPirPowerOn,
+        .pirArm = simPirArm,
+        .motionWake = simMotionWake,
+        .pirOff = simPirOff
+    };
+    slave_state_t state;
+    uint32_t mail_days = 0;
+    char line[200];
+
+    slaveStateReset(&state);
+
+    while(sim.now_us < sim.end_us) {
+        ++sim.ledger.wakes;
+        sim.radio_on = false;
+        spend(&sim, POWER_BOOT_OVERHEAD_US + SIM_WAKE_WORK_US);
+
+        sleep_mode_t mode = slaveStep(&state, 1, &io);
+        uint64_t wake_us = mode == SLEEP_AWAIT_MOTION ? nextMotionUs(&sim) : sim.now_us + slaveSleepUs(&timing, mode);
+
+        if(wake_us > sim.end_us) {
+            wake_us = sim.end_us;
+        }
+        if(wake_us > sim.now_us) {
+            powerLedgerAdd(&sim.ledger, POWER_DEEP_SLEEP, wake_us - sim.now_us);
+            sim.now_us = wake_us;
+        }
+    }
+    simPirOff(&sim);
+
+    if(trace->mail) {
+        mail_days = trace->days;
+    }
+    snprintf(line, sizeof(line), "%s: %.0f days, %.4f mAh per event, %.4f mAh/day, %lu wakes, %lu sends (%lu lost), %lu events over %lu deliveries",
+             trace->name, powerProjectedDays(&sim.ledger, &profile), powerChargePerEventMah(&sim.ledger, &profile),
+             powerChargeMah(&sim.ledger, &profile) / (powerElapsedHours(&sim.ledger) / 24.0),
+             (unsigned long)sim.ledger.wakes, (unsigned long)sim.ledger.tx_attempts, (unsigned long)sim.ledger.delivery_failures,
+             (unsigned long)sim.ledger.events, (unsigned long)mail_days);
+    TEST_MESSAGE(line);
+    return sim.ledger;
+}
+
+
+void test_quiet_week(void) {
+    power_ledger_t ledger = runTrace(&quiet_week);
+
+    TEST_ASSERT_EQUAL_UINT32(0, ledger.tx_attempts); /* Nothing to report, radio never started. */
+    TEST_ASSERT_EQUAL_UINT32(0, ledger.events);
+    TEST_ASSERT_TRUE(powerProjectedDays(&ledger, &profile) >= MIN_DAYS_QUIET_WEEK);
+}
+
+void test_daily_delivery(void) {
+    power_ledger_t ledger = runTrace(&daily_delivery);
+
+    TEST_ASSERT_EQUAL_UINT32(0, ledger.delivery_failures);
+    TEST_ASSERT_TRUE(ledger.events >= 2 * (daily_delivery.days - 1)); /* Arrival and emptied, every day. */
+    TEST_ASSERT_TRUE(powerProjectedDays(&ledger, &profile) >= MIN_DAYS_DAILY_DELIVERY);
+    TEST_ASSERT_TRUE(powerChargePerEventMah(&ledger, &profile) <= MAX_MAH_PER_EVENT_DAILY_DELIVERY);
+}
+
+void test_flaky_link(void) {
+    power_ledger_t ledger = runTrace(&flaky_link);
+
+    TEST_ASSERT_TRUE(ledger.delivery_failures > 0);
+    TEST_ASSERT_TRUE(ledger.events > 0);
+    TEST_ASSERT_TRUE(powerProjectedDays(&ledger, &profile) >= MIN_DAYS_FLAKY_LINK);
+    TEST_ASSERT_TRUE(powerChargePerEventMah(&ledger, &profile) <= MAX_MAH_PER_EVENT_FLAKY_LINK);
+}
+
+void test_master_offline(void) {
+    power_ledger_t ledger = runTrace(&master_offline);
+
+    /* Every wake that sees mail burns all tries and never arms the PIR. */
+    TEST_ASSERT_EQUAL_UINT32(0, ledger.events);
+    TEST_ASSERT_EQUAL_UINT32(ledger.tx_attempts, ledger.delivery_failures);
+    TEST_ASSERT_EQUAL_UINT64(0, ledger.time_us[POWER_PIR]);
+    TEST_ASSERT_TRUE(powerProjectedDays(&ledger, &profile) >= MIN_DAYS_MASTER_OFFLINE);
+}
+
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_quiet_week);
+    RUN_TEST(test_daily_delivery);
+    RUN_TEST(test_flaky_link);
+    RUN_TEST(test_master_offline);
+    return UNITY_END();
+}
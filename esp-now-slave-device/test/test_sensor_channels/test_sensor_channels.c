@@ -0,0 +1,160 @@
+/*
+Author: Marcellus Von Sacramento
+Purpose: Host tests for the sensor channel table and its pin mask helpers.
+Run with: pio test -e native -f test_sensor_channels
+*/
+
+#include <unity.h>
+#include "sensor_channels.h"
+#include "../../../misc-headers/esp-now-message-struct.h"
+
+#define COUNT_OF(table) (sizeof(table) / sizeof(table[0]))
+/* Transistor pins main.c drives as outputs. */
+#define RESERVED_PINS (SENSOR_PIN_BIT(26) | SENSOR_PIN_BIT(27) | SENSOR_PIN_BIT(32))
+
+/* Same pins as the table in main.c with both example rows enabled. */
+static const sensor_channel_t channels[] = {
+    { .ir_read_pin = 25, .pir_read_pin = 33 },
+    { .ir_read_pin = 4, .pir_read_pin = 34 },
+    { .ir_read_pin = 13, .pir_read_pin = 35 },
+};
+
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+
+void test_valid_table(void) {
+    TEST_ASSERT_TRUE(sensorChannelsValid(channels, COUNT_OF(channels), RESERVED_PINS));
+}
+
+void test_rejects_empty_table(void) {
+    TEST_ASSERT_FALSE(sensorChannelsValid(channels, 0, RESERVED_PINS));
+}
+
+void test_rejects_too_many_channels(void) {
+    /* IR on plain GPIO, PIR on free RTC GPIO, none repeated. One row more than a frame can carry. */
+    static const uint8_t ir_pins[] = { 5, 16, 17, 18, 19, 21, 22, 23, 25 };
+    static const uint8_t pir_pins[] = { 0, 2, 4, 12, 13, 14, 15, 34, 35 };
+    sensor_channel_t table[MAX_SENSOR_CHANNELS + 1];
+
+    for(size_t i = 0; i < COUNT_OF(table); ++i) {
+        table[i].ir_read_pin = ir_pins[i];
+        table[i].pir_read_pin = pir_pins[i];
+    }
+
+    TEST_ASSERT_TRUE(sensorChannelsValid(table, MAX_SENSOR_CHANNELS, RESERVED_PINS));
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, MAX_SENSOR_CHANNELS + 1, RESERVED_PINS));
+}
+
+void test_rejects_duplicate_pins(void) {
+    sensor_channel_t table[] = {
+        { .ir_read_pin = 25, .pir_read_pin = 33 },
+        { .ir_read_pin = 4, .pir_read_pin = 33 }, /* PIR shared with channel 0. */
+    };
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+
+    table[1].pir_read_pin = 25; /* IR pin of channel 0 reused as a PIR pin. */
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+
+    table[1].ir_read_pin = 34; /* Same pin for IR and PIR of one channel. */
+    table[1].pir_read_pin = 34;
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+}
+
+void test_rejects_non_rtc_pir_pin(void) {
+    sensor_channel_t table[] = { { .ir_read_pin = 25, .pir_read_pin = 5 } };
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+}
+
+void test_rejects_ir_pin_without_pull_up(void) {
+    sensor_channel_t table[] = { { .ir_read_pin = 34, .pir_read_pin = 33 } };
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+
+    table[0].ir_read_pin = 39;
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+
+    table[0].ir_read_pin = 4;
+    TEST_ASSERT_TRUE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+}
+
+void test_rejects_reserved_pins(void) {
+    sensor_channel_t table[] = { { .ir_read_pin = 25, .pir_read_pin = 32 } }; /* PIR transistor. */
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+    TEST_ASSERT_TRUE(sensorChannelsValid(table, COUNT_OF(table), 0));
+
+    table[0].pir_read_pin = 33;
+    table[0].ir_read_pin = 26; /* IR sensor transistor. */
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+}
+
+void test_rejects_missing_and_flash_pins(void) {
+    static const uint8_t bad_pins[] = { 6, 7, 8, 9, 10, 11, 20, 24, 28, 29, 30, 31 };
+    sensor_channel_t table[] = { { .ir_read_pin = 25, .pir_read_pin = 33 } };
+
+    for(size_t i = 0; i < COUNT_OF(bad_pins); ++i) {
+        table[0].ir_read_pin = bad_pins[i];
+        TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), 0));
+    }
+}
+
+void test_rejects_out_of_range_pin(void) {
+    sensor_channel_t table[] = { { .ir_read_pin = 25, .pir_read_pin = SENSOR_GPIO_PIN_COUNT } };
+    TEST_ASSERT_FALSE(sensorChannelsValid(table, COUNT_OF(table), RESERVED_PINS));
+}
+
+void test_ir_mask(void) {
+    TEST_ASSERT_EQUAL_HEX64(SENSOR_PIN_BIT(25) | SENSOR_PIN_BIT(4) | SENSOR_PIN_BIT(13),
+                            sensorChannelsIrMask(channels, COUNT_OF(channels)));
+}
+
+void test_pir_mask_round_trip(void) {
+    for(uint8_t channel_mask = 0; channel_mask < (1U << COUNT_OF(channels)); ++channel_mask) {
+        uint64_t pins = sensorChannelsPirMask(channels, COUNT_OF(channels), channel_mask);
+        TEST_ASSERT_EQUAL_HEX8(channel_mask, sensorChannelsFromPins(channels, COUNT_OF(channels), pins));
+    }
+
+    TEST_ASSERT_EQUAL_HEX64(SENSOR_PIN_BIT(33) | SENSOR_PIN_BIT(35),
+                            sensorChannelsPirMask(channels, COUNT_OF(channels), 0x05));
+    /* Pins that belong to no channel are ignored. */
+    TEST_ASSERT_EQUAL_HEX8(0x02, sensorChannelsFromPins(channels, COUNT_OF(channels), SENSOR_PIN_BIT(34) | SENSOR_PIN_BIT(2)));
+}
+
+void test_beam_levels_from_high_register(void) {
+    /* GPIO32-39 land in GPIO_IN1_REG, the upper half of the snapshot. 33 is the only free one with a pull-up. */
+    static const sensor_channel_t high[] = {
+        { .ir_read_pin = 25, .pir_read_pin = 34 },
+        { .ir_read_pin = 33, .pir_read_pin = 35 },
+        { .ir_read_pin = 4, .pir_read_pin = 36 },
+    };
+
+    TEST_ASSERT_TRUE(sensorChannelsValid(high, COUNT_OF(high), RESERVED_PINS));
+    TEST_ASSERT_EQUAL_HEX8(0x00, sensorChannelsBeamLevels(high, COUNT_OF(high), 0));
+    TEST_ASSERT_EQUAL_HEX8(0x07, sensorChannelsBeamLevels(high, COUNT_OF(high),
+                                                          SENSOR_PIN_BIT(25) | SENSOR_PIN_BIT(33) | SENSOR_PIN_BIT(4)));
+    TEST_ASSERT_EQUAL_HEX8(0x02, sensorChannelsBeamLevels(high, COUNT_OF(high), SENSOR_PIN_BIT(33)));
+    /* Other pins in the register do not leak into the levels. */
+    TEST_ASSERT_EQUAL_HEX8(0x02, sensorChannelsBeamLevels(high, COUNT_OF(high),
+                                                          SENSOR_PIN_BIT(33) | SENSOR_PIN_BIT(32) | SENSOR_PIN_BIT(34) | SENSOR_PIN_BIT(24)));
+}
+
+
+int main(void) {
+    UNITY_BEGIN();
+    RUN_TEST(test_valid_table);
+    RUN_TEST(test_rejects_empty_table);
+    RUN_TEST(test_rejects_too_many_channels);
+    RUN_TEST(test_rejects_duplicate_pins);
+    RUN_TEST(test_rejects_non_rtc_pir_pin);
+    RUN_TEST(test_rejects_ir_pin_without_pull_up);
+    RUN_TEST(test_rejects_reserved_pins);
+    RUN_TEST(test_rejects_missing_and_flash_pins);
+    RUN_TEST(test_rejects_out_of_range_pin);
+    RUN_TEST(test_ir_mask);
+    RUN_TEST(test_pir_mask_round_trip);
+    RUN_TEST(test_beam_levels_from_high_register);
+    return UNITY_END();
+}
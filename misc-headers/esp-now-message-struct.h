@@ -13,10 +13,22 @@ typedef struct esp_message {
 	char message[101];
 } esp_message;
 
+#define MAX_SENSOR_CHANNELS 8 /* One bit per channel in esp_batch_message. */
+
+/* Reports every mailbox on a slave in one frame. Bit n of each mask is channel n. */
+typedef struct esp_batch_message {
+	uint8_t flag; /* Always SENSOR_READ_BATCH. Must stay first to line up with esp_message.flag. */
+	uint8_t channel_count;
+	uint8_t beam_levels; /* Bit set: beam unbroken (empty). Bit clear: beam broken (mail). */
+	uint8_t changed; /* Channels whose state caused this report. */
+	char message[101];
+} esp_batch_message;
+
 typedef enum message_flag {
 	NORMAL_MESSAGE, /* Used for normal communication. Sensor read level can be ignored. */
 	SENSOR_READ, /* Used for sending sensor read level. Sensor read level must not be ignored if this flag is used. */
-	ERROR_BROADCAST
+	ERROR_BROADCAST,
+	SENSOR_READ_BATCH /* Used for sending esp_batch_message. */
 } message_flag;
 
 #endif /* ESP_NOW_MESSAGE_STRUCT */
\ No newline at end of file